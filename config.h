@@ -12,12 +12,48 @@ static int colors[] = {
         [C_FIL] = 0xff, /* Regular file */
         [C_HRD] = 0x00, /* TODO: Hard link */
         [C_LNK] = 0x33, /* Symbolic link */
-        [C_MIS] = 0x00, /* TODO: Missing file OR file details */
+        [C_MIS] = 0xf1, /* Missing file OR file details */
         [C_ORP] = 0x00, /* TODO: Orphaned symlink */
         [C_PIP] = 0x00, /* TODO: Named pipe (FIFO) */
         [C_SOC] = 0x2e, /* Socket */
         [C_UND] = 0x00, /* TODO: Unknown OR 0B regular/exe file */
         [C_INF] = 0xf7, /* Information */
+        [C_ADD] = 0x2e, /* Only in the compared directory */
+        [C_DEL] = 0xc4, /* Only in the current directory */
+        [C_CHG] = 0xe2, /* Changed between the two */
+};
+
+/* shortest time between two redraws while keys are coming in */
+static const int frame_ms = 16;
+
+/* files removed per second while the trash is emptied */
+static const int purgerate = 5000;
+
+/* listings with more entries than this are spilled to $TMPDIR */
+static const ulong bigents = 1000000;
+/* or whose names and records take more than this, also the sort's budget */
+static const size_t bigmem = 64 << 20;
+
+/* file system calls that take longer than this are abandoned */
+static const int fsdeadline_ms = 400;
+/* timeouts in a row before a mount's metadata is skipped */
+static const int fsdegrade = 3;
+/* seconds before stat(2) is retried on a degraded mount */
+static const int fsretry = 30;
+
+static const Rule rules[] = {
+        /* ext      magic                  len  flags       argv */
+        {  NULL,    "%PDF-",               5,   RULE_BG,    {"zathura"} },
+        {  NULL,    "\x89PNG\r\n\x1a\n",    8,   RULE_BG,    {"sxiv"} },
+        {  NULL,    "\xff\xd8\xff",         3,   RULE_BG,    {"sxiv"} },
+        {  NULL,    "GIF8",                4,   RULE_BG,    {"sxiv"} },
+        {  "mkv",   NULL,                  0,   RULE_BG,    {"mpv"} },
+        {  "mp4",   NULL,                  0,   RULE_BG,    {"mpv"} },
+        {  "webm",  NULL,                  0,   RULE_BG,    {"mpv"} },
+        {  "mp3",   NULL,                  0,   0,          {"mpv"} },
+        {  "flac",  NULL,                  0,   0,          {"mpv"} },
+        {  "html",  NULL,                  0,   RULE_BG,    {"firefox"} },
+        {  NULL,    NULL,                  0,   RULE_TEXT,  {"$EDITOR"} },
 };
 
 static Key keys[] = {
@@ -34,6 +70,10 @@ static Key keys[] = {
         {  'g',            nav,             {.n = NAV_TOP} },
         {  'G',            nav,             {.n = NAV_BOTTOM} },
         {  ' ',            nav,             {.n = NAV_SELECT} },
+        {  'a',            selop,           {.n = SEL_ALL} },
+        {  'A',            selop,           {.n = SEL_INVERT} },
+        {  '*',            selop,           {.n = SEL_GLOB} },
+        {  'c',            selop,           {.n = SEL_CLEAR} },
         {  '.',            nav,             {.n = NAV_SHOWALL} },
         {  'i',            nav,             {.n = NAV_INFO} },
         {  CTRL('r'),      nav,             {.n = NAV_REDRAW} },
@@ -41,13 +81,36 @@ static Key keys[] = {
         {  '~',            cd,              {.s = "/home/christos"} },
         {  CTRL('b'),      cd,              {.s = "/storage"} },
         /* TODO: get rid of builtinrun */
-        {  'p',            builtinrun,      {.n = RUN_PAGER} },
+        {  'p',            view,            {.v = NULL} },
+        {  'P',            builtinrun,      {.n = RUN_PAGER} },
         {  'e',            builtinrun,      {.n = RUN_EDITOR} },
         {  'o',            builtinrun,      {.n = RUN_OPENWITH} },
         {  'r',            builtinrun,      {.n = RUN_RENAME} },
-        {  'x',            run,             {.s = "rm -rf"} },
+        {  'x',            trash,           {.v = NULL} },
+        {  'X',            run,             {.s = "rm -rf"} },
+        {  'T',            trashlist,       {.v = NULL} },
+        {  'u',            restore,         {.v = NULL} },
+        {  CTRL('x'),      trashempty,      {.v = NULL} },
         {  's',            sort,            {.v = NULL} },
+        {  'D',            dupfind,         {.v = NULL} },
+        {  'C',            cmpstart,        {.v = NULL} },
+        {  '/',            grepstart,       {.v = NULL} },
+        {  'E',            tarextract,      {.v = NULL} },
         {  ':',            prompt,          {.v = NULL} },
+        {  't',            tabnew,          {.v = NULL} },
+        {  'w',            tabclose,        {.v = NULL} },
+        {  '1',            tabgo,           {.n = 0} },
+        {  '2',            tabgo,           {.n = 1} },
+        {  '3',            tabgo,           {.n = 2} },
+        {  '4',            tabgo,           {.n = 3} },
+        {  '5',            tabgo,           {.n = 4} },
+        {  '6',            tabgo,           {.n = 5} },
+        {  '7',            tabgo,           {.n = 6} },
+        {  '8',            tabgo,           {.n = 7} },
+        {  '9',            tabgo,           {.n = 8} },
+#ifdef PERF
+        {  CTRL('p'),      perfhud,         {.v = NULL} },
+#endif /* PERF */
 };
 
 #endif /* CONFIG_H */
@@ -9,11 +9,15 @@ BIN_DIR = ${PREFIX}/bin
 
 # includes and libs
 INCS = -Iinclude 
-LIBS = -Llib -lncursesw
+LIBS = -Llib -lncursesw -lpthread
+
+# instrumentation: perf counters, profiling overlay (^P, -p) and
+# chrome trace_event export (-t)
+#PERFFLAGS = -DPERF
 
 # flags
 CPPFLAGS = -D_DEFAULT_SOURCE -D_BSD_SOURCE -D_POSIX_C_SOURCE=200809L \
-	   -D_XOPEN_SOURCE=700 -DVERSION=\"${VERSION}\"
+	   -D_XOPEN_SOURCE=700 -DVERSION=\"${VERSION}\" ${PERFFLAGS}
 CFLAGS = -std=c99 -pedantic -Wall -Os ${INCS} ${CPPFLAGS}
 LDFLAGS = ${LIBS}
 
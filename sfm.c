@@ -1,19 +1,33 @@
 /* See LICENSE file for copyright and license details. */
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#endif /* __linux__ */
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <ftw.h>
 #include <limits.h>
 #include <locale.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 
 #include <ncurses.h>
+#include <pthread.h>
+#include <regex.h>
 
 #ifndef PATH_MAX
 #define PATH_MAX 1024
@@ -35,6 +49,10 @@
 #define DT_LNK 10
 #endif /* DT_LNK */
 
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif /* RENAME_NOREPLACE */
+
 #ifndef ESC
 #define ESC 27
 #endif /* ESC */
@@ -44,7 +62,37 @@
 
 #define DELAY_MS 350000
 #define SCROLLOFF 4
+#define SELCAP_MIN 64           /* initial selection set capacity */
+#define ARG_HEADROOM 2048       /* argv space left for the child, see xargs(1) */
+#define RULE_ARGS 4             /* argv slots of an opener rule */
+#define SNIFFLEN 512            /* bytes read for content detection */
+#define OPENCACHE 256           /* opener cache slots, power of two */
+#define FSWORKERS 8             /* max file system worker threads */
+#define PARMAX 64               /* max threads of a parallel() run */
+#define PARBUF (256 << 10)      /* per thread I/O buffer of parallel() */
+#define DUPBLOCK 4096           /* head and tail bytes hashed first */
+#define GREPMAX 100000          /* matches kept before a search gives up */
+#define GREPSNIP 256            /* bytes of a matching line shown */
+#define GREPBIN 8192            /* bytes checked for NUL to call a file binary */
+#define TARBLOCK 512
+#define TARMETA (1 << 20)       /* largest pax header an archive may have */
+#define TARCACHE 4              /* archive indexes kept in memory */
+#define TRASHDIRS 8             /* trash directories remembered */
+#define PURGEBATCH 64           /* removals between rate checks */
+#define VIEWSTEP 256            /* lines between line index entries */
+#define VIEWBLK 65536           /* line index entries per allocation */
+#define VIEWCHUNK (1 << 22)     /* bytes indexed between progress updates */
+#define VIEWFOLLOW_MS 250
+#define VIEWTAB 8
+#define MOUNTS 32               /* mounts tracked for timeouts */
+#define TABS 9                  /* one per digit key */
+#define TABBURST 256            /* changes applied in place before a rescan */
+#define TABBUF 16384            /* inotify(7) events read at once */
+#define BIGWIN 512              /* entries of a big listing kept stat(2)ed */
+#define BIGCHUNK 65536          /* sort keys made between page drops */
+#define BIGFLUSH 4096           /* records merged between page drops */
 
+#undef CTRL                     /* <sys/ioctl.h> may bring its own */
 #define CTRL(x)         ((x) & 0x1f)
 #define YMAX            (getmaxy(stdscr))
 #define XMAX            (getmaxx(stdscr))
@@ -52,7 +100,38 @@
 #define MAX(x, y)       ((x) > (y) ? (x) : (y))
 #define ARRLEN(x)       (sizeof(x) / sizeof(x[0]))
 #define ISDIGIT(x)      ((unsigned int)(x) - '0' <= 9)
-#define ENTSORT(e, n)   (qsort((e), (n), sizeof(*(e)), sortfn))
+#define ENTSORT(e, n)   do {                                            \
+        PERF_BEGIN(P_SORT);                                             \
+        qsort((e), (n), sizeof(*(e)), sortfn);                          \
+        PERF_END(P_SORT);                                               \
+} while (0)
+
+#ifdef PERF
+#define PERF_BEGIN(id)  Perfmark perf_##id; perfbegin(&perf_##id)
+#define PERF_END(id)    perfend((id), &perf_##id)
+#define PERF_ARG(id, v) (perf_##id.arg = (v))
+#define PERF_SYS(n)     (__atomic_fetch_add(&perfsys, (n), __ATOMIC_RELAXED))
+#define PERF_BYTES(n)   (__atomic_fetch_add(&perfbytes, (n), __ATOMIC_RELAXED))
+#define PERF_THREAD(s)  (traceattach(s))
+#define PERFOPTS        "pt:r:"
+#define PERFUSAGE       "p] [-t trace.json] [-r script"
+#define PERFBUCKETS     256
+#define TRACERING       4096    /* events per thread, power of two */
+#define TRACEFLUSH_MS   50
+#define REPLAYROWS      40
+#define REPLAYCOLS      120
+#define REPLAYKEYS      64      /* keys per action, ungetch(3) has a cap */
+#define REPLAYEND       (KEY_MAX + 1)
+#else
+#define PERF_BEGIN(id)
+#define PERF_END(id)
+#define PERF_ARG(id, v)
+#define PERF_SYS(n)
+#define PERF_BYTES(n)
+#define PERF_THREAD(s)
+#define PERFOPTS        ""
+#define PERFUSAGE       ""
+#endif /* PERF */
 
 /* type definitions */
 typedef unsigned char uchar;
@@ -69,18 +148,341 @@ typedef struct {
         char             date[12];
         char             sizestr[12];
         char            *name;
+        char            *aux;   /* listing specific column, may be NULL */
+        char            *note;  /* shown after the name, may be NULL */
         ushort           nlen;
         uchar            flags;
-        uchar            selected;
+        uchar            auxcolor;      /* C_INF if 0 */
 } Entry;
 
+typedef struct {
+        ull              key;           /* for the current sort, see bigkey() */
+        ull              pos;           /* name offset << 8 | d_type */
+} Bigrec;
+
+/*
+ * A listing with more than bigents entries or bigmem bytes. Names and
+ * records live in unlinked temporary files, both in listing order, and
+ * only the entries around the cursor are stat(2)ed into win[].
+ */
+typedef struct {
+        FILE            *namesfp;
+        FILE            *recsfp;
+        char            *names;         /* mmap(2)ed, NUL separated */
+        size_t           nameslen;
+        Bigrec          *recs;          /* mmap(2)ed */
+        ulong            n;
+        int              dfd;           /* the directory, for fstatat(2) */
+        ulong            misses;        /* win[] refills, to drop pages */
+        ulong            base;          /* first record bigkeys() works on */
+        Entry            win[BIGWIN];   /* entry i is in win[i % BIGWIN] */
+        ulong            tags[BIGWIN];  /* i + 1, 0 if the slot is free */
+} Bigdir;
+
 typedef struct {
         Entry           *ents;
         ulong            nents;
         long             sel;
-        long             nsel;
+        int              mode;  /* M_*, what the listing shows */
+        Bigdir          *big;   /* replaces ents above bigents entries */
 } Win;
 
+/*
+ * Everything that shapes a listing, kept while another tab is shown. The
+ * globals (win, curdir, curscroll, the sort flags, ...) always belong to
+ * the tab on screen, tabsave() copies them back.
+ */
+typedef struct {
+        Win              win;
+        char             dir[PATH_MAX];
+        char             label[PATH_MAX + NAME_MAX + 4]; /* winlabel */
+        struct timespec  mtime;         /* of dir, when win was last in sync */
+        dev_t            dev;
+        int              curscroll;
+        int              wd;            /* inotify(7) watch, -1 if none */
+        int            (*sortfn)(const void *, const void *);
+        uchar            namesort;
+        uchar            sizesort;
+        uchar            datesort;
+        uchar            revsort;
+        uchar            showall;
+        uchar            stale;         /* rescan before showing it again */
+} Tab;
+
+typedef struct {
+        dev_t            dev;
+        ino_t            ino;
+        char            *path;  /* absolute, NULL if the slot is free */
+} Selent;
+
+typedef struct {
+        char            *path;
+        off_t            off;           /* of the data in the archive */
+        off_t            size;
+        time_t           mtime;
+        mode_t           mode;
+} Tarmember;
+
+typedef struct {
+        dev_t            dev;
+        ino_t            ino;
+        time_t           mtime;
+        int              fd;
+        ulong            used;          /* lru clock, 0 if the slot is free */
+        Tarmember       *m;
+        ulong            n;
+        char             name[NAME_MAX + 1];
+} Tarindex;
+
+/* an XDG trash directory and the top directory of its volume */
+typedef struct {
+        dev_t            dev;
+        char             path[PATH_MAX];
+        char             top[PATH_MAX];         /* "" for the home trash */
+} Trash;
+
+/*
+ * A file system call run by a worker thread. The submitter waits for it
+ * only up to a deadline; a job that times out is abandoned and freed by
+ * whoever drops the last reference.
+ */
+typedef struct Fsjob {
+        struct Fsjob    *next;
+        void           (*fn)(struct Fsjob *);
+        int              refs;
+        int              phase;         /* FS_*, protected by fslock */
+        int              err;
+        int              fd;
+        char             path[PATH_MAX];
+        struct stat      st;            /* the directory/file itself */
+        /* fsload */
+        uchar            nostat;
+        uchar            showall;
+        char            *names;         /* NUL separated */
+        size_t           nameslen;
+        uchar           *dtypes;
+        struct stat     *sts;
+        ulong            n;
+        ulong            nstat;         /* sts[0..nstat) are valid */
+        ulong            seen;          /* entries read so far */
+        ulong            spill;         /* spill above this many, 0 never */
+        size_t           spillmem;      /* or above this many bytes */
+        FILE            *namesfp;       /* spilled listing, see Bigdir */
+        FILE            *recsfp;
+        /* fssniff */
+        char             buf[SNIFFLEN];
+        ssize_t          nbuf;
+        /* fsmap, two private mappings of st.st_size bytes */
+        uchar           *map;
+        uchar           *imap;
+        /* fstrash, for the device in st.st_dev */
+        Trash           *trash;
+        /* fstar */
+        Tarindex        *tar;
+        /* fsstat, DT_* of the name itself */
+        uchar            dtype;
+} Fsjob;
+
+typedef struct {
+        dev_t            dev;
+        int              deadline;      /* ms */
+        uint             timeouts;      /* consecutive */
+        time_t           degraded;      /* when, 0 if healthy */
+} Mount;
+
+typedef struct {
+        const char      *ext;           /* file name suffix, NULL for any */
+        const char      *magic;         /* leading bytes, NULL for any */
+        uchar            mlen;
+        uchar            flags;
+        const char      *argv[RULE_ARGS]; /* "$VAR" is read from environ */
+} Rule;
+
+typedef struct {
+        dev_t            dev;
+        ino_t            ino;
+        time_t           mtime;
+        off_t            size;
+        int              rule;          /* index in rules[], -1 for none */
+        uchar            used;
+} Opencache;
+
+typedef struct {
+        char            *src;
+        char            *dst;
+        ulong            ent;           /* index in win->ents */
+        uchar            state;         /* REN_* */
+} Rename;
+
+/* xxhash64 state, four independent lanes over 32 byte stripes */
+typedef struct {
+        ull              v[4];
+        ull              total;
+        uchar            buf[32];
+        size_t           nbuf;
+} Hash;
+
+typedef struct {
+        void           (*fn)(void *, ulong, uchar *);
+        void            *ctx;
+        ulong            n;
+        ulong            next;
+} Par;
+
+typedef struct {
+        char            *path;
+        off_t            size;
+        dev_t            dev;
+        ino_t            ino;
+        mode_t           mode;
+        time_t           ctime;
+        ull              hash;
+        ull              reclaim;       /* of the group */
+        ulong            group;
+        ulong            ref;           /* compared with, see dupverify() */
+        uchar            bad;           /* unreadable or different, drop it */
+} Dupfile;
+
+typedef struct {
+        Dupfile         *files;
+        ulong            n;
+        ulong            cap;
+        char           **roots;
+        ulong            nroots;
+        ulong            nhashed;       /* progress */
+        ulong            ntohash;
+        int              refs;
+        uchar            done;
+        uchar            cancel;
+} Dupjob;
+
+typedef struct {
+        char            *pat;
+        uchar            neg;           /* "!pat" */
+        uchar            dironly;       /* "pat/" */
+        uchar            anchored;      /* has a '/' before the end */
+} Ignpat;
+
+/* the patterns of .gitignore and .ignore files, from a directory upwards */
+typedef struct Ignore {
+        struct Ignore   *up;
+        char            *dir;           /* "" or "a/b/", under the root */
+        Ignpat          *pats;
+        ulong            n;
+        int              refs;
+} Ignore;
+
+typedef struct {
+        char            *dir;
+        Ignore          *ig;
+} Grepdir;
+
+typedef struct {
+        char            *path;
+        ulong            line;
+        char            *snip;
+        struct stat      st;
+} Grepres;
+
+/* same scheme as Cmpjob, a queue of directories and idle workers */
+typedef struct {
+        char             pat[BUFSIZ];
+        char             lit[BUFSIZ];   /* must occur in every match */
+        size_t           nlit;
+        size_t           rare;          /* index of lit's rarest byte */
+        uchar            pure;          /* the pattern is lit itself */
+        pthread_mutex_t  lock;
+        pthread_cond_t   cond;
+        Grepdir         *queue;
+        ulong            nq;
+        ulong            capq;
+        Grepres         *res;
+        ulong            n;
+        ulong            cap;
+        ulong            nfiles;        /* searched so far */
+        int              nth;
+        int              idle;
+        int              refs;
+        int              dfd;           /* where it started, paths are under it */
+        uchar            showall;
+        uchar            cancel;
+        uchar            done;
+} Grepjob;
+
+typedef struct {
+        char            *path;          /* relative to both roots */
+        struct stat      st;            /* the right side's, if it has one */
+        uchar            what;          /* CMP_* */
+} Cmpres;
+
+/*
+ * Directories still to compare are queued; workers take one, compare both
+ * sides and queue the subdirectories they have in common. The walk ends
+ * when the queue is empty and every worker is waiting.
+ */
+typedef struct {
+        char             roots[2][PATH_MAX];
+        pthread_mutex_t  lock;
+        pthread_cond_t   cond;
+        char           **queue;
+        ulong            nq;
+        ulong            capq;
+        Cmpres          *res;
+        ulong            n;
+        ulong            cap;
+        ulong            ndirs;         /* compared so far */
+        int              nth;
+        int              idle;
+        int              refs;
+        uchar            data;          /* compare contents of same-sized */
+        uchar            cancel;
+        uchar            done;
+} Cmpjob;
+
+typedef struct {
+        const char      *name;
+        long             m;             /* member, -1 for implied dirs */
+} Tarchild;
+
+typedef struct {
+        char           (*dirs)[PATH_MAX];
+        int              n;
+        ulong            nrm;           /* files removed so far */
+        long             t0;            /* msclock() when it started */
+} Purge;
+
+/*
+ * Built-in pager. The file is mmap(2)ed and shown from any offset right
+ * away; a thread builds a sparse index of line starts meanwhile, which is
+ * only needed to jump to a line number.
+ */
+typedef struct {
+        int              fd;
+        const uchar     *map;
+        size_t           size;          /* bytes mapped for display */
+        off_t            top;           /* offset of the first row */
+        off_t          **blk;           /* start of every VIEWSTEP-th line */
+        ulong            nblk;
+        ulong            nidx;          /* index entries published */
+        ull              nl;            /* newlines seen by the indexer */
+        off_t            idxend;        /* bytes indexed so far */
+        const uchar     *imap;          /* the indexer's own mapping */
+        size_t           isize;
+        pthread_t        th;
+        uchar            indexing;
+        uchar            cancel;
+        uchar            hex;
+        uchar            follow;
+        const char      *name;
+} View;
+
+/* open addressing, linear probing, capacity is a power of two */
+typedef struct {
+        Selent          *ents;
+        ulong            cap;
+        ulong            n;
+} Selset;
+
 typedef union {
         int n;
         const char *s;
@@ -93,10 +495,53 @@ typedef struct {
         const Arg arg;
 } Key;
 
+#ifdef PERF
+typedef struct {
+        ull              ns;
+        ulong            sys;
+        ulong            bytes;
+        long             arg;
+} Perfmark;
+
+typedef struct {
+        ulong            calls;
+        ulong            sys;
+        ulong            bytes;
+        ulong            hist[PERFBUCKETS]; /* log-linear latency buckets */
+} Perfstat;
+
+typedef struct {
+        ull              ts;
+        ull              dur;
+        long             arg;
+        uchar            id;
+} Traceev;
+
+/* single producer (owning thread), single consumer (flusher) */
+typedef struct Tracebuf {
+        Traceev          ev[TRACERING];
+        ulong            head;
+        ulong            tail;
+        ulong            lost;
+        int              tid;
+        const char      *name;          /* not announced yet, see traceflush() */
+        uchar            idle;          /* its thread exited, up for reuse */
+        struct Tracebuf *next;
+} Tracebuf;
+#endif /* PERF */
+
 
 enum {
         DIR_OR_DIRLNK   = 1 << 0,
         HARD_LNK        = 1 << 1,
+        ENT_MEMBER      = 1 << 6, /* archive member, not on disk */
+        ENT_MISSING     = 1 << 7, /* metadata timed out */
+};
+
+enum {
+        FS_QUEUED,
+        FS_LISTED,
+        FS_DONE,
 };
 
 enum {
@@ -120,9 +565,43 @@ enum {
         RUN_RENAME,
 };
 
+enum {
+        RULE_BG         = 1 << 0, /* detach, don't wait for the program */
+        RULE_TEXT       = 1 << 1, /* match files without NUL bytes */
+};
+
+enum {
+        M_DIR,
+        M_DUPS,
+        M_TAR,
+        M_TRASH,
+        M_CMP,
+        M_GREP,
+};
+
+enum {
+        CMP_ADDED,      /* only on the right */
+        CMP_REMOVED,    /* only on the left */
+        CMP_TYPE,
+        CMP_META,       /* mode, owner or mtime */
+        CMP_DATA,       /* size or contents */
+};
+
+enum {
+        REN_TODO,
+        REN_ACTIVE,
+        REN_DONE,
+};
+
+enum {
+        SEL_ALL,
+        SEL_INVERT,
+        SEL_GLOB,
+        SEL_CLEAR,
+};
+
 enum {
         CMD_OPEN,
-        CMD_MV,
 };
 
 enum {
@@ -134,12 +613,43 @@ enum {
 enum {
         MSG_OPENWITH,
         MSG_RENAME,
+        MSG_RENAMEN,
         MSG_EXEC,
+        MSG_SELGLOB,
         MSG_SORT,
         MSG_PROMPT,
         MSG_FAIL,
+        MSG_TIMEOUT,
+        MSG_DUPSCAN,
+        MSG_DUPNONE,
+        MSG_BUSY,
+        MSG_TARBAD,
+        MSG_VIEWLINE,
+        MSG_VIEWPCT,
+        MSG_VIEWIDX,
+        MSG_CMPWITH,
+        MSG_CMPDATA,
+        MSG_GREP,
+        MSG_REGEX,
+        MSG_BIGSEL,
 };
 
+#ifdef PERF
+enum {
+        P_LOOP,
+        P_KEY,
+        P_READDIR,
+        P_ENTGET,
+        P_STAT,
+        P_SORT,
+        P_PRINT,
+        P_SPAWN,
+        P_TARINDEX,
+        P_VIEWINDEX,
+        P_LAST,
+};
+#endif /* PERF */
+
 /* Colors */
 enum {
         C_BLK = 1, /* Block device */
@@ -155,38 +665,240 @@ enum {
         C_SOC, /* Socket */
         C_UND, /* Unknown OR 0B regular/exe file */
         C_INF, /* Information */
+        C_ADD, /* Only in the compared directory */
+        C_DEL, /* Only in the current directory */
+        C_CHG, /* Changed between the two */
 };
 
 /* function declarations */
 static void      cursesinit(void);
-static ulong     entcount(char *);
-static Entry    *entget(char *, ulong);
+static void      entfill(Entry *, const char *, uchar, const struct stat *);
+static Entry    *entget(char *, ulong *, Bigdir **, struct timespec *);
+static Entry    *entat(ulong);
+static FILE     *bigtmp(void);
+static int       bigspill(Fsjob *);
+static void      bigput(Fsjob *, const char *, size_t, uchar);
+static int       bigmap(Bigdir *);
+static void      bigdrop(Bigdir *);
+static void      bigflush(Bigdir *);
+static Bigdir   *bigload(Fsjob *);
+static void      bigfree(Bigdir *);
+static Entry    *bigent(Bigdir *, ulong);
+static ull       bigkey(const char *);
+static void      bigstat(void *, ulong, uchar *);
+static void      bigkeys(Bigdir *);
+static int       bigcmp(const void *, const void *);
+static int       bigrun(Bigdir *, ulong, ulong);
+static void      bigsift(ulong *, const ulong *, ulong, ulong);
+static int       bigmerge(Bigdir *, const ulong *, ulong);
+static void      bigsort(Bigdir *);
 static void      entprint(void);
 static char     *fmtsize(size_t);
 static void      notify(int, const char *);
 static char     *promptstr(const char *);
 static int       confirmact(const char *);
 static int       spawn(char *);
+static int       spawnv(char *const []);
+static int       spawnbg(char *const []);
+static int       rulematch(const Entry *);
+static void      openfile(const Entry *);
+static ulong     inohash(dev_t, ino_t);
+static Selent   *selfind(dev_t, ino_t);
+static void      selgrow(ulong);
+static int       selhas(const Entry *);
+static char     *selpath(const Entry *);
+static void      seladd(const Entry *);
+static void      seldel(Selent *);
+static void      seltoggle(const Entry *);
+static void      selclear(void);
+static void      selop(const Arg *);
 static void      nav(const Arg *);
 static void      cd(const Arg *);
 static void      run(const Arg *);
 static void      builtinrun(const Arg *);
+static int       renamecmp(const void *, const void *);
+static int       renamedstcmp(const void *, const void *);
+static long      renamefind(Rename **, ulong, const char *);
+static int       renamenx(int, const char *, const char *);
+static int       renameplan(Rename *, ulong, int);
+static void      bulkrename(void);
 static void      sort(const Arg *);
+static void      hashinit(Hash *, ull);
+static void      hashupdate(Hash *, const void *, size_t);
+static ull       hashfinal(Hash *);
+static void     *parworker(void *);
+static void      parallel(ulong, void (*)(void *, ulong, uchar *), void *);
+static int       dupinocmp(const void *, const void *);
+static int       duphashcmp(const void *, const void *);
+static int       dupgroupcmp(const void *, const void *);
+static int       dupwalk(const char *, const struct stat *, int, struct FTW *);
+static void      duphash(void *, ulong, uchar *);
+static void      duphashfull(void *, ulong, uchar *);
+static void      dupverify(void *, ulong, uchar *);
+static void      dupkeep(Dupjob *, int);
+static void      dupput(Dupjob *);
+static void     *dupscan(void *);
+static void      dupfind(const Arg *);
+static int       strptrcmp(const void *, const void *);
+static void      cmpput(Cmpjob *);
+static void      cmpemit(Cmpjob *, const char *, const struct stat *, int);
+static char    **cmpread(const char *, ulong *);
+static int       cmpdata(const char *, const char *, off_t, uchar *);
+static int       cmpentry(Cmpjob *, const char *, const char *,
+                          const struct stat *, const struct stat *, uchar *);
+static void      cmpdir(Cmpjob *, const char *, uchar *);
+static void     *cmpworker(void *);
+static void      cmpcancel(void);
+static void      cmpsync(void);
+static void      cmpstart(const Arg *);
+static Ignore   *ignload(Ignore *, int, const char *);
+static void      ignput(Ignore *);
+static int       ignored(const Ignore *, const char *, int);
+static void      greplit(Grepjob *);
+static const uchar *grepfind(const Grepjob *, const uchar *, const uchar *);
+static ulong     nlcount(const uchar *, const uchar *);
+static void      grepemit(Grepjob *, const char *, ulong, const uchar *,
+                          size_t, const struct stat *);
+static void      grepfile(Grepjob *, regex_t *, const char *,
+                          const struct stat *, uchar *);
+static void      greppush(Grepjob *, char *, Ignore *);
+static void      grepdir(Grepjob *, regex_t *, Grepdir *, uchar *);
+static void     *grepworker(void *);
+static void      grepput(Grepjob *);
+static int       grepcmp(const void *, const void *);
+static void      grepcancel(void);
+static void      grepsync(void);
+static void      grepstart(const Arg *);
+static void      grepedit(const Entry *);
+static ull       tarnum(const char *, size_t);
+static int       tarbuild(Tarindex *);
+static Tarindex *tarindex(const Entry *);
+static void      tarfree(Tarindex *);
+static int       tarchildcmp(const void *, const void *);
+static void      tarlist(void);
+static void      taropen(const Entry *);
+static int       tarcopy(const Entry *, int);
+static int       tarmember(const Entry *, char *, size_t);
+static void      tarextract(const Arg *);
+static int       tmprm(const char *, const struct stat *, int, struct FTW *);
+static int       mkpath(const char *, mode_t);
+static void      trashhome(char *, size_t);
+static void      trashtop(const char *, dev_t, char *);
+static Trash    *trashfor(const char *, dev_t);
+static void      urlenc(FILE *, const char *);
+static void      urldec(char *);
+static int       trashput(const char *);
+static int       trashorig(const char *, char *, char *);
+static int       trashdirs(char (*)[PATH_MAX]);
+static void      trash(const Arg *);
+static void      trashlist(const Arg *);
+static int       untrash(const char *);
+static void      restore(const Arg *);
+static int       purgerm(const char *, const struct stat *, int, struct FTW *);
+static void     *purge(void *);
+static void      trashempty(const Arg *);
+static ull       nlmask(ull);
+static void      viewadd(View *, off_t);
+static off_t     viewidx(View *, ulong);
+static void      viewscan(View *, const uchar *, off_t, off_t);
+static void     *viewindex(void *);
+static int       viewopen(View *, const char *);
+static void      viewclose(View *);
+static off_t     viewnext(View *, off_t);
+static off_t     viewprev(View *, off_t);
+static off_t     viewend(View *);
+static off_t     viewline(View *, ull);
+static long      viewlineno(View *, off_t);
+static void      viewrow(const uchar *, size_t);
+static void      viewdraw(View *);
+static void      viewremap(View *);
+static void      view(const Arg *);
 static void      prompt(const Arg *);
 static void      selcorrect(void);
+static long      msclock(void);
+static int       keymotion(int);
+static void      keyrun(int);
+static void      input(void);
+static void      draw(void);
 static void      entcleanup(void);
-static void      escape(char *, const char *);
+static void      tabsave(void);
+static void      tabload(int);
+static void      tableave(void);
+static void      tabwatch(Tab *);
+static void      tabunwatch(Tab *);
+static long      tabfind(const Win *, const char *);
+static void      tabremove(Tab *, ulong);
+static long      tabinsert(Tab *, const char *);
+static void      tabapply(Tab *, uint, const char *);
+static void      tabsync(void);
+static void      tabprint(void);
+static void      tabnew(const Arg *);
+static void      tabgo(const Arg *);
+static void      tabclose(const Arg *);
 static void      xdelay(useconds_t);
-static void      echdir(const char *);
+static int       echdir(const char *, dev_t, struct stat *);
+static void      fsinit(void);
+static void     *fsworker(void *);
+static Fsjob    *fsjobnew(void (*)(Fsjob *), const char *);
+static void      fsjobput(Fsjob *);
+static void      fssubmit(Fsjob *);
+static void      fsphase(Fsjob *, int);
+static int       fswait(Fsjob *, int, const struct timespec *);
+static void      fsdeadline(struct timespec *, int);
+static void      fsload(Fsjob *);
+static void      fsopen(Fsjob *);
+static void      fssniff(Fsjob *);
+static void      fsstat(Fsjob *);
+static void      fsfile(Fsjob *);
+static void      fsmap(Fsjob *);
+static void      fstrash(Fsjob *);
+static void      fstar(Fsjob *);
+static Fsjob    *fsrun(void (*)(Fsjob *), const char *, dev_t);
+static Mount    *mntget(dev_t);
+static int       mntdegraded(Mount *);
+static void      mntresult(Mount *, int);
 static void     *emalloc(size_t);
+static char     *estrdup(const char *);
 static void      cleanup(void);
 static void      usage(void);
 static void      die(const char *, ...);
+#ifdef PERF
+static ull       perfclock(void);
+static void      perfbegin(Perfmark *);
+static void      perfend(int, const Perfmark *);
+static ull       perfpct(const Perfstat *, int);
+static char     *fmtns(ull);
+static int       replaykeys(const char *, int *, int);
+static void      replaypopulate(const char *, long);
+static void     *replaydrain(void *);
+static void      replayterm(void);
+static void      replay(void);
+static int       ullcmp(const void *, const void *);
+static void      perfreset(void);
+static void      perfhud(const Arg *);
+static void      perfdraw(void);
+static void      perfdump(void);
+static Tracebuf *traceattach(const char *);
+static void      tracedetach(void *);
+static void      tracepush(int, const Perfmark *, ull);
+static int       traceflush(void);
+static void     *traceloop(void *);
+static void      traceopen(const char *);
+static void      traceclose(void);
+#endif /* PERF */
 
 /* useful strings */
 static const char *cmds[] = {
         [CMD_OPEN] = "xdg-open",
-        [CMD_MV] = "mv",
+};
+
+static const char *modenames[] = {
+        [M_DIR] = "",
+        [M_DUPS] = "duplicates",
+        [M_TAR] = "tar",
+        [M_TRASH] = "trash",
+        [M_CMP] = "compare",
+        [M_GREP] = "grep",
 };
 
 static const char *envs[] = {
@@ -197,19 +909,94 @@ static const char *envs[] = {
 
 static const char *msgs[] = {
         [MSG_OPENWITH] = "open with: ",
-        [MSG_RENAME] = "rename: ",
+        [MSG_RENAME] = "rename: invalid or duplicate names",
+        [MSG_RENAMEN] = "rename: line count changed",
         [MSG_EXEC] = "execute '%s' (y/N)?",
+        [MSG_SELGLOB] = "select: ",
         [MSG_SORT] = "'n'ame 's'ize 'd'ate 'r'everse",
         [MSG_PROMPT] = ":",
-        [MSG_FAIL] = "action failed"
+        [MSG_FAIL] = "action failed",
+        [MSG_TIMEOUT] = "file system not responding",
+        [MSG_DUPSCAN] = "duplicates: %lu files, %lu/%lu hashed (ESC stops)",
+        [MSG_DUPNONE] = "no duplicates",
+        [MSG_BUSY] = "still busy, try again",
+        [MSG_CMPWITH] = "compare with: ",
+        [MSG_GREP] = "grep: ",
+        [MSG_REGEX] = "bad regular expression",
+        [MSG_CMPDATA] = "compare contents too (y/N)?",
+        [MSG_TARBAD] = "not a tar archive",
+        [MSG_VIEWLINE] = "line: ",
+        [MSG_VIEWPCT] = "percent: ",
+        [MSG_VIEWIDX] = "still indexing, try again",
+        [MSG_BIGSEL] = "too many entries, select with '*'",
+};
+
+#ifdef PERF
+static const char *perfnames[] = {
+        [P_LOOP] = "loop",
+        [P_KEY] = "key",
+        [P_READDIR] = "readdir",
+        [P_ENTGET] = "entget",
+        [P_STAT] = "stat",
+        [P_SORT] = "sort",
+        [P_PRINT] = "entprint",
+        [P_SPAWN] = "spawn",
+        [P_TARINDEX] = "tarindex",
+        [P_VIEWINDEX] = "viewindex",
 };
+#endif /* PERF */
+
+extern char **environ;
 
 /* globals variables */
-static Win *win = NULL;         /* main display */
+static Win *win = NULL;         /* listing of the tab on screen */
 static char *curdir = NULL;     /* current directory */
 static int cur = 0;             /* cursor position */
 static int curscroll = 0;       /* cursor scroll */
-static int scrolldir;           /* scroll direction */
+static long lastdraw;           /* msclock() at the last redraw */
+static Selset selset;           /* selected files, keyed by (dev, ino) */
+static Opencache opencache[OPENCACHE]; /* opener rule per (dev, ino, mtime) */
+static Mount mounts[MOUNTS];    /* per device timeout state */
+static dev_t curdev = 0;        /* device of the current directory */
+static Dupjob *dupcur = NULL;   /* duplicate scan being walked by nftw(3) */
+static Purge *purgecur = NULL;  /* trash being emptied by nftw(3) */
+static Cmpjob *curcmp = NULL;   /* comparison feeding M_CMP */
+static Grepjob *curgrep = NULL; /* search feeding M_GREP */
+static Bigdir *bigcur = NULL;   /* listing being sorted by bigsort() */
+static const char *cmpnames[] = {
+        [CMP_ADDED] = "added",
+        [CMP_REMOVED] = "removed",
+        [CMP_TYPE] = "type",
+        [CMP_META] = "meta",
+        [CMP_DATA] = "data",
+};
+static const uchar cmpcolors[] = {
+        [CMP_ADDED] = C_ADD,
+        [CMP_REMOVED] = C_DEL,
+        [CMP_TYPE] = C_CHG,
+        [CMP_META] = C_CHG,
+        [CMP_DATA] = C_CHG,
+};
+static uchar f_dupbusy = 0;     /* a duplicate scan is still running */
+static uchar f_purgebusy = 0;   /* the trash is still being emptied */
+static Trash trashes[TRASHDIRS];
+static int ntrash = 0;
+static Tarindex tarcache[TARCACHE]; /* per (dev, ino, mtime) */
+static Tarindex *curtar = NULL; /* archive shown by M_TAR */
+static char tarprefix[PATH_MAX];/* directory inside curtar, "" or "a/b/" */
+static ulong tarclock = 0;
+static char winlabel[PATH_MAX + NAME_MAX + 4]; /* next to the mode name */
+static char tmpdir[PATH_MAX];   /* where members are extracted for viewing */
+static Tab tabs[TABS];
+static int ntabs = 1, curtab = 0;
+static int infd = -1;           /* inotify(7) instance watching the tabs */
+
+/* file system workers */
+static pthread_mutex_t fslock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fswork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t fsdone;   /* on CLOCK_MONOTONIC, see fsinit() */
+static Fsjob *fsqueue = NULL, *fsqtail = NULL;
+static int fsidle = 0, fsnworkers = 0;
 
 /* flags */
 static uchar f_showall = 0;     /* show hidden files */
@@ -224,6 +1011,23 @@ static uchar f_running = 1;     /* 0 when sfm should exit */
 
 static int (*sortfn)(const void *x, const void *y);
 
+#ifdef PERF
+static Perfstat perf[P_LAST];   /* cumulative counters */
+static Perfstat perffrm[P_LAST];/* counters for the last refresh */
+static ulong perfsys = 0;       /* syscalls issued so far */
+static ulong perfbytes = 0;     /* bytes allocated so far */
+static uchar f_perfhud = 0;     /* show profiling overlay */
+static uchar f_perfdump = 0;    /* dump counters on exit */
+static FILE *tracefp = NULL;    /* trace_event output, NULL if not tracing */
+static Tracebuf *tracebufs = NULL; /* per-thread rings, lock-free list */
+static pthread_key_t tracekey;
+static pthread_t traceth;
+static int tracetids = 0;
+static ull traceepoch;
+static uchar f_tracestop = 0;
+static const char *replayfile = NULL; /* key script run by -r */
+#endif /* PERF */
+
 #include "config.h"
 
 /* function implementations */
@@ -268,7 +1072,8 @@ cursesinit(void)
 {
         int i = 1;
 
-        if (!initscr())
+        /* a replay sets up its own screen with newterm(3) */
+        if (stdscr == NULL && !initscr())
                 die("initscr:");
 
         noecho();
@@ -284,208 +1089,690 @@ cursesinit(void)
                 init_pair(i, colors[i], COLOR_BLACK);
 }
 
-static ulong
-entcount(char *path)
+static void
+entfill(Entry *ent, const char *name, uchar dtype, const struct stat *st)
 {
-        DIR *dir;
-        struct dirent *dent;
-        int n = 0;
+        struct tm *tm;
+        char type;
 
-        /* FIXME: repating code, do something! */
-        if ((dir = opendir(path)) == NULL)
-                die("opendir:");
+        ent->nlen = strlen(name);
+        ent->name = estrdup(name);
+        ent->aux = NULL;
+        ent->note = NULL;
+        ent->auxcolor = 0;
+        ent->flags = dtype;
 
-        while ((dent = readdir(dir)) != NULL) {
-                if (!strcmp(dent->d_name, "..") || !strcmp(dent->d_name, "."))
-                        continue;
-                if (!f_showall && dent->d_name[0] == '.')
-                        continue;
-                n++;
+        if (st != NULL) {
+                ent->stat = *st;
+                tm = localtime(&ent->stat.st_ctime);
+                strftime(ent->date, 12, "%F", tm);
+                strcpy(ent->sizestr, fmtsize(ent->stat.st_size));
+        } else {
+                /* placeholder, all we know is what readdir(3) told us */
+                memset(&ent->stat, 0, sizeof(ent->stat));
+                switch (dtype) {
+                case DT_DIR:
+                        ent->stat.st_mode = S_IFDIR;
+                        break;
+                case DT_LNK:
+                        ent->stat.st_mode = S_IFLNK;
+                        break;
+                default:
+                        ent->stat.st_mode = S_IFREG;
+                        break;
+                }
+                ent->flags |= ENT_MISSING;
+                strcpy(ent->date, "?");
+                strcpy(ent->sizestr, "?");
+                sprintf(ent->statstr, "? %s", msgs[MSG_TIMEOUT]);
+                return;
+        }
 
+        /* FIXME: links don't work */
+        switch (ent->stat.st_mode & S_IFMT) {
+        case S_IFREG:
+                type = '-';
+                break;
+        case S_IFDIR:
+                type = 'd';
+                break;
+        case S_IFLNK:
+                type = 'l';
+                break;
+        case S_IFSOCK:
+                type = 's';
+                break;
+        case S_IFIFO:
+                type = 'p';
+                break;
+        case S_IFBLK:
+                type = 'b';
+                break;
+        case S_IFCHR:
+                type = 'c';
+                break;
+        default:
+                type = '?';
+                break;
         }
-        (void)closedir(dir);
 
-        return n;
+        /* seperate field for lsperms? */
+        sprintf(ent->statstr, "%c%c%c%c%c%c%c%c%c%c %s %s",
+                type,
+                ent->stat.st_mode & S_IRUSR ? 'r' : '-',
+                ent->stat.st_mode & S_IWUSR ? 'w' : '-',
+                ent->stat.st_mode & S_IXUSR ? 'x' : '-',
+                ent->stat.st_mode & S_IRGRP ? 'r' : '-',
+                ent->stat.st_mode & S_IWGRP ? 'w' : '-',
+                ent->stat.st_mode & S_IXGRP ? 'x' : '-',
+                ent->stat.st_mode & S_IROTH ? 'r' : '-',
+                ent->stat.st_mode & S_IWOTH ? 'w' : '-',
+                ent->stat.st_mode & S_IXOTH ? 'x' : '-',
+                ent->sizestr, ent->date);
 }
 
+/*
+ * Listing and stat(2) run on a worker; whatever hasn't finished by the
+ * mount's deadline shows up as a placeholder. A listing that keeps growing
+ * isn't stuck, so each new batch of names buys it another deadline.
+ */
 static Entry *
-entget(char *path, ulong n)
+entget(char *path, ulong *n, Bigdir **big, struct timespec *mtime)
 {
-        DIR *dir;
-        struct dirent *dent;
-        struct tm *tm;
-        Entry *ents;
-        int i = 0;
-        char type;
-        
-        ents = emalloc(n * sizeof(Entry));
-        if ((dir = opendir(path)) == NULL)
-                die("opendir:");
+        Fsjob *job;
+        Mount *mnt = mntget(curdev);
+        Entry *ents = NULL;
+        struct timespec dl;
+        const char *name;
+        ulong i = 0, nstat, seen = 0;
 
-        while ((dent = readdir(dir)) != NULL) {
-                if (!strcmp(dent->d_name, "..") || !strcmp(dent->d_name, "."))
-                        continue;
-                if (!f_showall && dent->d_name[0] == '.')
-                        continue;
+        PERF_BEGIN(P_ENTGET);
+        *n = 0;
+        *big = NULL;
+        job = fsjobnew(fsload, path);
+        job->nostat = mntdegraded(mnt);
+        job->showall = f_showall;
+        job->spill = bigents;
+        job->spillmem = bigmem;
+        fssubmit(job);
 
-                ents[i].nlen = strlen(dent->d_name);
-                ents[i].name = emalloc(ents[i].nlen + 1);
-                strcpy(ents[i].name, dent->d_name);
+        fsdeadline(&dl, mnt->deadline);
+        while (fswait(job, FS_LISTED, &dl) < FS_LISTED) {
+                if (__atomic_load_n(&job->seen, __ATOMIC_RELAXED) == seen) {
+                        mntresult(mnt, 0);
+                        notify(MSG_TIMEOUT, NULL);
+                        goto out;
+                }
+                seen = __atomic_load_n(&job->seen, __ATOMIC_RELAXED);
+                fsdeadline(&dl, mnt->deadline);
+        }
+        if (job->err != 0) {
+                notify(MSG_FAIL, NULL);
+                goto out;
+        }
+        curdev = job->st.st_dev;
+        *mtime = job->st.st_mtim;
+        mnt = mntget(curdev);
 
-                stat(ents[i].name, &ents[i].stat);
-                tm = localtime(&ents[i].stat.st_ctime);
-                strftime(ents[i].date, 12, "%F", tm);
-                strcpy(ents[i].sizestr, fmtsize(ents[i].stat.st_size));
+        if (job->namesfp != NULL) {
+                if ((*big = bigload(job)) == NULL)
+                        notify(MSG_FAIL, NULL);
+                else
+                        *n = (*big)->n;
+                goto out;
+        }
 
-                ents[i].flags = 0;
-                /* FIXME: resets on every redraw, keep track somehow */
-                ents[i].selected = 0;
-                ents[i].flags |= dent->d_type;
+        fswait(job, FS_DONE, &dl);
+        nstat = __atomic_load_n(&job->nstat, __ATOMIC_ACQUIRE);
+        if (!job->nostat)
+                mntresult(mnt, nstat == job->n);
 
-                /* TODO: use fstatat(3) */
+        ents = emalloc(job->n * sizeof(Entry));
+        for (name = job->names; i < job->n; i++, name += strlen(name) + 1)
+                entfill(&ents[i], name, job->dtypes[i],
+                        i < nstat ? &job->sts[i] : NULL);
+        *n = job->n;
+        ENTSORT(ents, *n);
+out:
+        fsjobput(job);
+        PERF_END(P_ENTGET);
 
-                /* FIXME: links don't work */
-                switch (ents[i].stat.st_mode & S_IFMT) {
-                case S_IFREG:
-                        type = '-';
-                        break;
-                case S_IFDIR:
-                        type = 'd';
-                        break;
-                case S_IFLNK:
-                        type = 'l';
-                        break;
-                case S_IFSOCK:
-                        type = 's';
-                        break;
-                case S_IFIFO:
-                        type = 'p';
-                        break;
-                case S_IFBLK:
-                        type = 'b';
-                        break;
-                case S_IFCHR:
-                        type = 'c';
-                        break;
-                default:
-                        type = '?';
-                        break;
-                }
+        return ents;
+}
+
+/* entry i of the listing, only valid until the next call for big ones */
+static Entry *
+entat(ulong i)
+{
+        if (win->big != NULL)
+                return bigent(win->big, i);
+        return &win->ents[i];
+}
 
-                /* seperate field for lsperms? */
-                sprintf(ents[i].statstr, "%c%c%c%c%c%c%c%c%c%c %s %s",
-                        type,
-                        ents[i].stat.st_mode & S_IRUSR ? 'r' : '-',
-                        ents[i].stat.st_mode & S_IWUSR ? 'w' : '-',
-                        ents[i].stat.st_mode & S_IXUSR ? 'x' : '-',
-                        ents[i].stat.st_mode & S_IRGRP ? 'r' : '-',
-                        ents[i].stat.st_mode & S_IWGRP ? 'w' : '-',
-                        ents[i].stat.st_mode & S_IXGRP ? 'x' : '-',
-                        ents[i].stat.st_mode & S_IROTH ? 'r' : '-',
-                        ents[i].stat.st_mode & S_IWOTH ? 'w' : '-',
-                        ents[i].stat.st_mode & S_IXOTH ? 'x' : '-',
-                        ents[i].sizestr, ents[i].date);
+/* an unlinked file under $TMPDIR */
+static FILE *
+bigtmp(void)
+{
+        char path[PATH_MAX];
+        const char *tmp;
+        FILE *fp;
+        int fd;
 
-                i++;
+        if ((tmp = getenv("TMPDIR")) == NULL)
+                tmp = "/tmp";
+        snprintf(path, sizeof(path), "%s/sfm.XXXXXX", tmp);
+        if ((fd = mkstemp(path)) < 0)
+                return NULL;
+        unlink(path);
+        if ((fp = fdopen(fd, "w+")) == NULL)
+                close(fd);
+
+        return fp;
+}
+
+/* move what fsload() has read so far to disk, stat(2) is left for later */
+static int
+bigspill(Fsjob *job)
+{
+        const char *name = job->names;
+        size_t len;
+        ulong i = 0, n = job->n;
 
+        if ((job->namesfp = bigtmp()) == NULL ||
+            (job->recsfp = bigtmp()) == NULL)
+                return -1;
+        job->nostat = 1;
+        job->n = job->nameslen = 0;
+        for (; i < n; i++, name += len) {
+                len = strlen(name) + 1;
+                bigput(job, name, len, job->dtypes[i]);
         }
-        (void)closedir(dir);
-        ENTSORT(ents, n);
+        free(job->names);
+        free(job->dtypes);
+        job->names = NULL;
+        job->dtypes = NULL;
 
-        return ents;
+        return ferror(job->namesfp) || ferror(job->recsfp) ? -1 : 0;
 }
 
 static void
-entprint(void)
+bigput(Fsjob *job, const char *name, size_t len, uchar dtype)
 {
-        Entry *ent;
-        int i = 0;
-        uint attrs;
-        uchar color;
-        char ind;
+        Bigrec rec;
 
-        attron(A_BOLD | COLOR_PAIR(C_DIR));
-        addstr(curdir);
-        attroff(A_BOLD | COLOR_PAIR(C_DIR));
+        rec.key = bigkey(name);
+        rec.pos = (ull)job->nameslen << 8 | dtype;
+        fwrite(name, 1, len, job->namesfp);
+        fwrite(&rec, sizeof(rec), 1, job->recsfp);
+        job->nameslen += len;
+        job->n++;
+}
 
-        /* TODO: change 4 to line ignore constant */
-        for (; i < win->nents && i <= YMAX - 4; i++) {
-                ent = &win->ents[i + curscroll];
-                ind = ' ';
-                attrs = 0;
-                color = 0;
+/* a short file (disk full) would SIGBUS on access, so check the sizes */
+static int
+bigmap(Bigdir *big)
+{
+        struct stat nst, rst;
 
-                move(i + 2, 0);
+        if (fflush(big->namesfp) != 0 || fflush(big->recsfp) != 0 ||
+            ferror(big->namesfp) || ferror(big->recsfp) ||
+            fstat(fileno(big->namesfp), &nst) != 0 ||
+            fstat(fileno(big->recsfp), &rst) != 0 ||
+            (size_t)nst.st_size < big->nameslen ||
+            (size_t)rst.st_size < big->n * sizeof(Bigrec))
+                return -1;
+        big->names = mmap(NULL, big->nameslen, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fileno(big->namesfp), 0);
+        big->recs = mmap(NULL, big->n * sizeof(Bigrec),
+                         PROT_READ | PROT_WRITE, MAP_SHARED,
+                         fileno(big->recsfp), 0);
+        if (big->names == MAP_FAILED || big->recs == MAP_FAILED) {
+                if (big->names != MAP_FAILED)
+                        munmap(big->names, big->nameslen);
+                if (big->recs != MAP_FAILED)
+                        munmap(big->recs, big->n * sizeof(Bigrec));
+                big->names = NULL;
+                big->recs = NULL;
+                return -1;
+        }
 
-                if (i == cur)
-                        attrs |= A_REVERSE;
+        return 0;
+}
 
-                if (f_info) {
-                        attron(COLOR_PAIR(C_INF));
-                        printw("%s  %c%c%c  %7s  ",
-                                ent->date,
-                                '0' + ((ent->stat.st_mode >> 6) & 7),
-                                '0' + ((ent->stat.st_mode >> 3) & 7),
-                                '0' + (ent->stat.st_mode & 7),
-                                ent->sizestr);
-                        attroff(COLOR_PAIR(C_INF));
-                }
+/* give back the pages touched so far, the files keep the data */
+static void
+bigdrop(Bigdir *big)
+{
+        madvise(big->names, big->nameslen, MADV_DONTNEED);
+        madvise(big->recs, big->n * sizeof(Bigrec), MADV_DONTNEED);
+}
 
-                addch(ent->selected ? '+' : ' ');
+static void
+bigflush(Bigdir *big)
+{
+        int i = 0;
 
-                switch (ent->stat.st_mode & S_IFMT) {
-                case S_IFDIR:
-                        ind = '/';
-                        color = C_DIR;
-                        attrs |= A_BOLD;
-                        break;
-                case S_IFREG:
-                        color = C_FIL;
-                        if (ent->stat.st_mode & 0100) {
-                                ind = '*';
-                                color = C_EXE;
-                        }
-                        break;
-                case S_IFLNK:
-                        ind = (ent->flags & DT_DIR) ? '/' : '@';
-                        color = C_LNK;
-                        if (S_ISDIR(ent->stat.st_mode))
-                                attrs |= A_BOLD;
-                        break;
-                case S_IFSOCK:
-                        ind = '=';
-                        color = C_SOC;
-                        break;
-                case S_IFIFO:
-                        ind = '|';
-                        color = C_PIP;
-                        break;
-                case S_IFBLK:
-                        color = C_BLK;
-                        break;
-                case S_IFCHR:
-                        color = C_CHR;
-                        break;
-                default:
-                        ind = '?';
-                        color = C_UND;
-                        break;
+        for (; i < BIGWIN; i++)
+                if (big->tags[i] != 0) {
+                        free(big->win[i].name);
+                        big->tags[i] = 0;
                 }
+}
 
-                attrs |= COLOR_PAIR(color);
-                attron(attrs);
-                addstr(ent->name);
-                attroff(attrs);
+static Bigdir *
+bigload(Fsjob *job)
+{
+        Bigdir *big;
 
-                addch(ind);
+        if ((big = calloc(1, sizeof(Bigdir))) == NULL)
+                die("calloc:");
+        big->dfd = -1;
+        big->namesfp = job->namesfp;
+        big->recsfp = job->recsfp;
+        job->namesfp = job->recsfp = NULL;
+        big->nameslen = job->nameslen;
+        big->n = job->n;
+        if (ferror(big->namesfp) || ferror(big->recsfp) ||
+            (big->dfd = open(job->path, O_RDONLY | O_DIRECTORY)) < 0 ||
+            bigmap(big) != 0) {
+                bigfree(big);
+                return NULL;
         }
+        bigsort(big);
 
-        mvprintw(YMAX - 1, 0, "%ld/%ld %s", win->sel + 1, win->nents,
-                 win->ents[win->sel].statstr);
+        return big;
 }
 
-static char *
-fmtsize(size_t sz)
+static void
+bigfree(Bigdir *big)
+{
+        bigflush(big);
+        if (big->names != NULL)
+                munmap(big->names, big->nameslen);
+        if (big->recs != NULL)
+                munmap(big->recs, big->n * sizeof(Bigrec));
+        fclose(big->namesfp);
+        fclose(big->recsfp);
+        if (big->dfd >= 0)
+                close(big->dfd);
+        free(big);
+}
+
+static Entry *
+bigent(Bigdir *big, ulong i)
+{
+        Entry *ent = &big->win[i % BIGWIN];
+        Mount *mnt = mntget(curdev);
+        Fsjob *job;
+        struct timespec dl;
+        const char *name;
+
+        if (big->tags[i % BIGWIN] == i + 1)
+                return ent;
+        if (big->tags[i % BIGWIN] != 0)
+                free(ent->name);
+        /* scrolling through it all shouldn't map it all in */
+        if (++big->misses % BIGWIN == 0)
+                bigdrop(big);
+
+        name = big->names + (big->recs[i].pos >> 8);
+        if (mntdegraded(mnt)) {
+                entfill(ent, name, big->recs[i].pos & 0xff, NULL);
+        } else {
+                /* the listing is the cwd, stat(2) the name on a worker */
+                job = fsjobnew(fsstat, name);
+                fssubmit(job);
+                fsdeadline(&dl, mnt->deadline);
+                if (fswait(job, FS_DONE, &dl) < FS_DONE) {
+                        mntresult(mnt, 0);
+                        entfill(ent, name, big->recs[i].pos & 0xff, NULL);
+                } else {
+                        mntresult(mnt, 1);
+                        if (job->err != 0)
+                                memset(&job->st, 0, sizeof(job->st));
+                        entfill(ent, name, big->recs[i].pos & 0xff, &job->st);
+                }
+                fsjobput(job);
+        }
+        big->tags[i % BIGWIN] = i + 1;
+
+        return ent;
+}
+
+/* leading bytes of a name, big endian, so they order like strcmp(3) */
+static ull
+bigkey(const char *name)
+{
+        ull key = 0;
+        int i = 0;
+
+        for (; i < 8; i++) {
+                key = key << 8 | (uchar)*name;
+                if (*name != '\0')
+                        name++;
+        }
+
+        return key;
+}
+
+static void
+bigstat(void *ctx, ulong i, uchar *buf)
+{
+        Bigdir *big = ctx;
+        Bigrec *rec = &big->recs[big->base + i];
+        struct stat st;
+
+        (void)buf;
+        if (fstatat(big->dfd, big->names + (rec->pos >> 8), &st, 0) != 0 &&
+            fstatat(big->dfd, big->names + (rec->pos >> 8), &st,
+                    AT_SYMLINK_NOFOLLOW) != 0)
+                memset(&st, 0, sizeof(st));
+        PERF_SYS(1);
+        /* largest first, like sizecmp() */
+        rec->key = f_sizesort ? ~(ull)st.st_size : (ull)st.st_ctime;
+}
+
+/* sorting by size or date has to stat(2) everything once */
+static void
+bigkeys(Bigdir *big)
+{
+        ulong i, n;
+
+        for (big->base = 0; big->base < big->n; big->base += n) {
+                n = MIN(big->n - big->base, BIGCHUNK);
+                if (!f_namesort && !mntdegraded(mntget(curdev))) {
+                        parallel(n, bigstat, big);
+                } else {
+                        for (i = big->base; i < big->base + n; i++)
+                                big->recs[i].key = !f_namesort ? 0 :
+                                    bigkey(big->names + (big->recs[i].pos >> 8));
+                }
+                bigdrop(big);
+        }
+}
+
+static int
+bigcmp(const void *x, const void *y)
+{
+        const Bigrec *a = x, *b = y;
+        int r;
+
+        if (a->key != b->key)
+                r = a->key < b->key ? -1 : 1;
+        else
+                r = strcmp(bigcur->names + (a->pos >> 8),
+                           bigcur->names + (b->pos >> 8));
+
+        return f_revsort ? -r : r;
+}
+
+/*
+ * Sort recs[a..b) and rewrite their names in the same order. Names always
+ * follow the records, so the names of a run are one contiguous block.
+ */
+static int
+bigrun(Bigdir *big, ulong a, ulong b)
+{
+        size_t lo = big->recs[a].pos >> 8, off = lo, len;
+        size_t hi = b < big->n ? big->recs[b].pos >> 8 : big->nameslen;
+        const char *name;
+        char *buf;
+        ulong i = a;
+
+        if ((buf = malloc(hi - lo)) == NULL)
+                return -1;
+        qsort(big->recs + a, b - a, sizeof(Bigrec), bigcmp);
+        for (; i < b; i++, off += len) {
+                name = big->names + (big->recs[i].pos >> 8);
+                len = strlen(name) + 1;
+                memcpy(buf + (off - lo), name, len);
+                big->recs[i].pos = (ull)off << 8 | (big->recs[i].pos & 0xff);
+        }
+        memcpy(big->names + lo, buf, hi - lo);
+        free(buf);
+        bigdrop(big);
+
+        return 0;
+}
+
+/* heap of runs, ordered by the record at[] points to in each */
+static void
+bigsift(ulong *heap, const ulong *at, ulong n, ulong i)
+{
+        Bigrec *recs = bigcur->recs;
+        ulong c, t;
+
+        for (; (c = 2 * i + 1) < n; i = c) {
+                if (c + 1 < n &&
+                    bigcmp(&recs[at[heap[c + 1]]], &recs[at[heap[c]]]) < 0)
+                        c++;
+                if (bigcmp(&recs[at[heap[c]]], &recs[at[heap[i]]]) >= 0)
+                        break;
+                t = heap[i];
+                heap[i] = heap[c];
+                heap[c] = t;
+        }
+}
+
+/* k-way merge of sorted runs into fresh files, read and written in order */
+static int
+bigmerge(Bigdir *big, const ulong *runs, ulong nruns)
+{
+        FILE *namesfp, *recsfp;
+        Bigrec rec;
+        const char *name;
+        size_t off = 0, len;
+        ulong *heap, *at, i = 0, nheap = nruns, nout = 0;
+        int err;
+
+        if ((namesfp = bigtmp()) == NULL)
+                return -1;
+        if ((recsfp = bigtmp()) == NULL) {
+                fclose(namesfp);
+                return -1;
+        }
+        heap = emalloc(nruns * sizeof(ulong));
+        at = emalloc(nruns * sizeof(ulong));
+        for (; i < nruns; i++) {
+                heap[i] = i;
+                at[i] = runs[i];
+        }
+        for (i = nheap / 2; i-- > 0;)
+                bigsift(heap, at, nheap, i);
+
+        while (nheap > 0) {
+                rec = big->recs[at[heap[0]]];
+                name = big->names + (rec.pos >> 8);
+                len = strlen(name) + 1;
+                fwrite(name, 1, len, namesfp);
+                rec.pos = (ull)off << 8 | (rec.pos & 0xff);
+                fwrite(&rec, sizeof(rec), 1, recsfp);
+                off += len;
+                if (++at[heap[0]] == runs[heap[0] + 1])
+                        heap[0] = heap[--nheap];
+                bigsift(heap, at, nheap, 0);
+                if (++nout % BIGFLUSH == 0)
+                        bigdrop(big);
+        }
+        free(heap);
+        free(at);
+
+        err = ferror(namesfp) || ferror(recsfp) ||
+              fflush(namesfp) != 0 || fflush(recsfp) != 0;
+        if (err) {
+                fclose(namesfp);
+                fclose(recsfp);
+                return -1;
+        }
+        munmap(big->names, big->nameslen);
+        munmap(big->recs, big->n * sizeof(Bigrec));
+        fclose(big->namesfp);
+        fclose(big->recsfp);
+        big->namesfp = namesfp;
+        big->recsfp = recsfp;
+        if (bigmap(big) != 0)
+                die("mmap:");
+
+        return 0;
+}
+
+/*
+ * External merge sort: runs that fit in half of bigmem, names included,
+ * are sorted in place, then merged in one pass.
+ */
+static void
+bigsort(Bigdir *big)
+{
+        ulong *runs = NULL, nruns = 0, cap = 0, a = 0, b;
+        size_t budget = bigmem / 2;
+
+        PERF_BEGIN(P_SORT);
+        bigcur = big;
+        bigflush(big);
+        bigkeys(big);
+        for (; a < big->n; a = b) {
+                /* names count twice, the block and its sorted copy */
+                for (b = a + 1; b < big->n && (b + 1 - a) * sizeof(Bigrec) +
+                     2 * ((b + 1 < big->n ? big->recs[b + 1].pos >> 8 :
+                           big->nameslen) - (big->recs[a].pos >> 8)) <= budget;
+                     b++)
+                        ;
+                if (bigrun(big, a, b) != 0)
+                        goto fail;
+                if (nruns + 1 >= cap) {
+                        cap = MAX(cap * 2, 16);
+                        if ((runs = realloc(runs, cap * sizeof(ulong))) == NULL)
+                                die("realloc:");
+                }
+                runs[nruns++] = a;
+        }
+        if (nruns > 1) {
+                runs[nruns] = big->n;
+                if (bigmerge(big, runs, nruns) != 0)
+                        goto fail;
+        }
+        goto out;
+fail:
+        notify(MSG_FAIL, NULL);
+out:
+        free(runs);
+        bigcur = NULL;
+        PERF_END(P_SORT);
+}
+
+static void
+entprint(void)
+{
+        Entry *ent;
+        int i = 0;
+        uint attrs;
+        uchar color;
+        char ind;
+
+        PERF_BEGIN(P_PRINT);
+        attron(A_BOLD | COLOR_PAIR(C_DIR));
+        addstr(curdir);
+        if (win->mode != M_DIR)
+                printw(" [%s%s]", modenames[win->mode], winlabel);
+        attroff(A_BOLD | COLOR_PAIR(C_DIR));
+
+        /* TODO: change 4 to line ignore constant */
+        for (; i + curscroll < win->nents && i <= YMAX - 4; i++) {
+                ent = entat(i + curscroll);
+                ind = ' ';
+                attrs = 0;
+                color = 0;
+
+                move(i + 2, 0);
+
+                if (i == cur)
+                        attrs |= A_REVERSE;
+
+                if (f_info) {
+                        attron(COLOR_PAIR(C_INF));
+                        printw("%s  %c%c%c  %7s  ",
+                                ent->date,
+                                '0' + ((ent->stat.st_mode >> 6) & 7),
+                                '0' + ((ent->stat.st_mode >> 3) & 7),
+                                '0' + (ent->stat.st_mode & 7),
+                                ent->sizestr);
+                        attroff(COLOR_PAIR(C_INF));
+                }
+
+                addch(selhas(ent) ? '+' : ' ');
+
+                if (ent->aux != NULL) {
+                        attron(COLOR_PAIR(ent->auxcolor ? ent->auxcolor :
+                                          C_INF));
+                        printw("%s  ", ent->aux);
+                        attroff(COLOR_PAIR(ent->auxcolor ? ent->auxcolor :
+                                           C_INF));
+                }
+
+                switch (ent->stat.st_mode & S_IFMT) {
+                case S_IFDIR:
+                        ind = '/';
+                        color = C_DIR;
+                        attrs |= A_BOLD;
+                        break;
+                case S_IFREG:
+                        color = C_FIL;
+                        if (ent->stat.st_mode & 0100) {
+                                ind = '*';
+                                color = C_EXE;
+                        }
+                        break;
+                case S_IFLNK:
+                        ind = (ent->flags & DT_DIR) ? '/' : '@';
+                        color = C_LNK;
+                        if (S_ISDIR(ent->stat.st_mode))
+                                attrs |= A_BOLD;
+                        break;
+                case S_IFSOCK:
+                        ind = '=';
+                        color = C_SOC;
+                        break;
+                case S_IFIFO:
+                        ind = '|';
+                        color = C_PIP;
+                        break;
+                case S_IFBLK:
+                        color = C_BLK;
+                        break;
+                case S_IFCHR:
+                        color = C_CHR;
+                        break;
+                default:
+                        ind = '?';
+                        color = C_UND;
+                        break;
+                }
+
+                if (ent->flags & ENT_MISSING)
+                        color = C_MIS;
+                attrs |= COLOR_PAIR(color);
+                attron(attrs);
+                addstr(ent->name);
+                attroff(attrs);
+
+                addch(ind);
+                if (ent->note != NULL) {
+                        attron(COLOR_PAIR(C_INF));
+                        addnstr(ent->note, MAX(XMAX - getcurx(stdscr) - 1,
+                                               0));
+                        attroff(COLOR_PAIR(C_INF));
+                }
+        }
+
+        mvprintw(YMAX - 1, 0, "%ld/%ld %s", win->sel + 1, win->nents,
+                 win->nents > 0 ? entat(win->sel)->statstr : "");
+        if (selset.n > 0)
+                printw("  %lu selected", selset.n);
+        PERF_END(P_PRINT);
+}
+
+static char *
+fmtsize(size_t sz)
 {
         static char buf[12];
         int i = 0;
@@ -510,7 +1797,17 @@ notify(int flag, const char *str)
                 printw(msgs[MSG_EXEC], str);
                 break;
         case MSG_FAIL: /* FALLTHROUGH */
+        case MSG_TIMEOUT: /* FALLTHROUGH */
+        case MSG_RENAME: /* FALLTHROUGH */
+        case MSG_DUPNONE: /* FALLTHROUGH */
+        case MSG_BUSY: /* FALLTHROUGH */
+        case MSG_TARBAD: /* FALLTHROUGH */
+        case MSG_VIEWIDX: /* FALLTHROUGH */
+        case MSG_CMPDATA: /* FALLTHROUGH */
+        case MSG_REGEX: /* FALLTHROUGH */
+        case MSG_RENAMEN: /* FALLTHROUGH */
         case MSG_SORT: /* FALLTHROUGH */
+        case MSG_BIGSEL: /* FALLTHROUGH */
                 addstr(msgs[flag]);
                 break;
         default:
@@ -552,350 +1849,5260 @@ promptstr(const char *msg)
         curs_set(0);
         noecho();
 
-        return str;
+        return str;
+}
+
+static int
+confirmact(const char *str)
+{
+        if (f_noconfirm)
+                return 1;
+        notify(MSG_EXEC, str);
+        return (getch() == 'y');
+}
+
+static int
+spawn(char *cmd)
+{
+        char *sh = getenv(envs[ENV_SHELL]);
+        char *args[] = {sh != NULL ? sh : "/bin/sh", "-c", cmd, NULL};
+
+        return spawnv(args);
+}
+
+static int
+spawnv(char *const argv[])
+{
+        pid_t pid;
+        int status, ret;
+
+        PERF_BEGIN(P_SPAWN);
+        endwin();
+        if ((ret = posix_spawnp(&pid, argv[0], NULL, NULL, argv,
+            environ)) == 0) {
+                while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+                        PERF_SYS(1);
+                PERF_SYS(2);
+        }
+        PERF_END(P_SPAWN);
+
+        return ret != 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+}
+
+/* start a program detached from the terminal, reaped in main() */
+static int
+spawnbg(char *const argv[])
+{
+        posix_spawn_file_actions_t fa;
+        posix_spawnattr_t attr;
+        pid_t pid;
+        int fd = 0, ret;
+
+        PERF_BEGIN(P_SPAWN);
+        posix_spawn_file_actions_init(&fa);
+        for (; fd < 3; fd++)
+                posix_spawn_file_actions_addopen(&fa, fd, "/dev/null",
+                                                 fd ? O_WRONLY : O_RDONLY, 0);
+        posix_spawnattr_init(&attr);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+        ret = posix_spawnp(&pid, argv[0], &fa, &attr, argv, environ);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&fa);
+        PERF_SYS(1);
+        PERF_END(P_SPAWN);
+
+        return ret != 0;
+}
+
+/* index of the first rule in rules[] matching ent, -1 if none */
+static int
+rulematch(const Entry *ent)
+{
+        Opencache *oc;
+        const Rule *r;
+        Fsjob *job = NULL;
+        struct timespec dl;
+        const char *ext;
+        ssize_t n = -1;
+        int i = 0;
+
+        oc = &opencache[inohash(ent->stat.st_dev, ent->stat.st_ino) &
+                        (OPENCACHE - 1)];
+        if (oc->used && oc->dev == ent->stat.st_dev &&
+            oc->ino == ent->stat.st_ino && oc->mtime == ent->stat.st_mtime &&
+            oc->size == ent->stat.st_size)
+                return oc->rule;
+
+        ext = strrchr(ent->name, '.');
+        for (; i < ARRLEN(rules); i++) {
+                r = &rules[i];
+                if (r->ext != NULL && (ext == NULL ||
+                    strcasecmp(ext + 1, r->ext) != 0))
+                        continue;
+                if (r->magic == NULL && !(r->flags & RULE_TEXT))
+                        break;
+                /* sniff once, only when a rule needs the contents */
+                if (n < 0) {
+                        job = fsjobnew(fssniff, ent->name);
+                        fssubmit(job);
+                        fsdeadline(&dl, mntget(ent->stat.st_dev)->deadline);
+                        if (fswait(job, FS_DONE, &dl) < FS_DONE) {
+                                mntresult(mntget(ent->stat.st_dev), 0);
+                                fsjobput(job);
+                                return -1;
+                        }
+                        n = MAX(job->nbuf, 0);
+                }
+                if (r->magic != NULL && (n < r->mlen ||
+                    memcmp(job->buf, r->magic, r->mlen) != 0))
+                        continue;
+                if (r->flags & RULE_TEXT && memchr(job->buf, '\0', n) != NULL)
+                        continue;
+                break;
+        }
+        if (job != NULL)
+                fsjobput(job);
+        if (i == ARRLEN(rules))
+                i = -1;
+
+        oc->dev = ent->stat.st_dev;
+        oc->ino = ent->stat.st_ino;
+        oc->mtime = ent->stat.st_mtime;
+        oc->size = ent->stat.st_size;
+        oc->rule = i;
+        oc->used = 1;
+
+        return i;
+}
+
+static void
+openfile(const Entry *ent)
+{
+        const Rule *r = NULL;
+        char *argv[RULE_ARGS + 2];
+        const char *arg;
+        int i = 0, n = 0, ri;
+
+        if ((ri = rulematch(ent)) >= 0)
+                r = &rules[ri];
+        if (r == NULL) {
+                argv[n++] = (char *)cmds[CMD_OPEN];
+        } else {
+                for (; i < RULE_ARGS && (arg = r->argv[i]) != NULL; i++) {
+                        if (arg[0] == '$' && (arg = getenv(arg + 1)) == NULL) {
+                                notify(MSG_FAIL, NULL);
+                                return;
+                        }
+                        argv[n++] = (char *)arg;
+                }
+        }
+        argv[n++] = ent->name;
+        argv[n] = NULL;
+
+        if (r == NULL || r->flags & RULE_BG) {
+                if (spawnbg(argv))
+                        notify(MSG_FAIL, NULL);
+        } else {
+                if (spawnv(argv))
+                        notify(MSG_FAIL, NULL);
+                f_redraw = 1;
+        }
+}
+
+static ulong
+inohash(dev_t dev, ino_t ino)
+{
+        ull h = (ull)ino * 0x9e3779b97f4a7c15ULL ^ (ull)dev;
+
+        h ^= h >> 32;
+        h *= 0xd6e8feb86659fd93ULL;
+        h ^= h >> 32;
+
+        return h;
+}
+
+/* slot holding (dev, ino), or the free slot it would go in */
+static Selent *
+selfind(dev_t dev, ino_t ino)
+{
+        Selent *se;
+        ulong i, mask = selset.cap - 1;
+
+        if (selset.cap == 0)
+                return NULL;
+        for (i = inohash(dev, ino) & mask;; i = (i + 1) & mask) {
+                se = &selset.ents[i];
+                if (se->path == NULL || (se->dev == dev && se->ino == ino))
+                        return se;
+        }
+}
+
+/* make room for n entries at a load factor of at most 1/2 */
+static void
+selgrow(ulong n)
+{
+        Selent *old = selset.ents, *se;
+        ulong cap = selset.cap, i = 0;
+
+        if (n * 2 <= selset.cap)
+                return;
+        for (selset.cap = MAX(selset.cap, SELCAP_MIN); selset.cap < n * 2;)
+                selset.cap <<= 1;
+        if ((selset.ents = calloc(selset.cap, sizeof(Selent))) == NULL)
+                die("calloc:");
+        PERF_BYTES(selset.cap * sizeof(Selent));
+
+        for (; i < cap; i++) {
+                if (old[i].path == NULL)
+                        continue;
+                se = selfind(old[i].dev, old[i].ino);
+                *se = old[i];
+        }
+        free(old);
+}
+
+static int
+selhas(const Entry *ent)
+{
+        Selent *se;
+
+        if (selset.n == 0)
+                return 0;
+        se = selfind(ent->stat.st_dev, ent->stat.st_ino);
+        return se->path != NULL;
+}
+
+/* absolute path of an entry in the current directory */
+static char *
+selpath(const Entry *ent)
+{
+        size_t len = strlen(curdir);
+        char *path;
+
+        /* virtual listings may hold absolute paths already */
+        if (ent->name[0] == '/')
+                return estrdup(ent->name);
+        path = emalloc(len + ent->nlen + 2);
+        sprintf(path, "%s%s%s", curdir,
+                len > 0 && curdir[len - 1] == '/' ? "" : "/", ent->name);
+
+        return path;
+}
+
+static void
+seladd(const Entry *ent)
+{
+        Selent *se;
+
+        if (ent->flags & (ENT_MISSING | ENT_MEMBER))
+                return;
+        selgrow(selset.n + 1);
+        se = selfind(ent->stat.st_dev, ent->stat.st_ino);
+        if (se->path != NULL)
+                return;
+
+        se->path = selpath(ent);
+        se->dev = ent->stat.st_dev;
+        se->ino = ent->stat.st_ino;
+        selset.n++;
+}
+
+/* backward shift deletion, keeps probe chains intact without tombstones */
+static void
+seldel(Selent *se)
+{
+        Selent *e;
+        ulong i = se - selset.ents, j = i, k, mask = selset.cap - 1;
+
+        free(se->path);
+        se->path = NULL;
+        selset.n--;
+
+        for (;;) {
+                j = (j + 1) & mask;
+                e = &selset.ents[j];
+                if (e->path == NULL)
+                        break;
+                k = inohash(e->dev, e->ino) & mask;
+                /* leave e alone if its home slot lies in (i, j] */
+                if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+                        continue;
+                selset.ents[i] = *e;
+                e->path = NULL;
+                i = j;
+        }
+}
+
+static void
+seltoggle(const Entry *ent)
+{
+        Selent *se;
+
+        if (selset.n > 0) {
+                se = selfind(ent->stat.st_dev, ent->stat.st_ino);
+                if (se->path != NULL) {
+                        seldel(se);
+                        return;
+                }
+        }
+        seladd(ent);
+}
+
+static void
+selclear(void)
+{
+        ulong i = 0;
+
+        for (; i < selset.cap && selset.n > 0; i++) {
+                if (selset.ents[i].path != NULL) {
+                        free(selset.ents[i].path);
+                        selset.ents[i].path = NULL;
+                        selset.n--;
+                }
+        }
+}
+
+static void
+selop(const Arg *arg)
+{
+        char *pat;
+        ulong i = 0;
+
+        /* a spilled listing is too big to walk through entat() */
+        if (win->big != NULL && (arg->n == SEL_ALL || arg->n == SEL_INVERT)) {
+                notify(MSG_BIGSEL, NULL);
+                xdelay(DELAY_MS << 2);
+                return;
+        }
+        switch (arg->n) {
+        case SEL_ALL:
+                selgrow(selset.n + win->nents);
+                for (; i < win->nents; i++)
+                        seladd(entat(i));
+                break;
+        case SEL_INVERT:
+                selgrow(selset.n + win->nents);
+                for (; i < win->nents; i++)
+                        seltoggle(entat(i));
+                break;
+        case SEL_GLOB:
+                if ((pat = promptstr(msgs[MSG_SELGLOB])) == NULL)
+                        return;
+                for (; i < win->nents; i++)
+                        if (fnmatch(pat, entat(i)->name, 0) == 0)
+                                seladd(entat(i));
+                free(pat);
+                break;
+        case SEL_CLEAR:
+                selclear();
+                break;
+        }
+}
+
+static void
+nav(const Arg *arg)
+{
+        Entry *ent, tmp;
+        char path[PATH_MAX], *p;
+
+        switch (arg->n) {
+        case NAV_LEFT:
+                if (win->mode == M_TAR && tarprefix[0] != '\0') {
+                        /* "a/b/" -> "a/" */
+                        tarprefix[strlen(tarprefix) - 1] = '\0';
+                        if ((p = strrchr(tarprefix, '/')) != NULL)
+                                p[1] = '\0';
+                        else
+                                tarprefix[0] = '\0';
+                        tarlist();
+                        break;
+                }
+                /* leave a virtual listing for the directory it came from */
+                if (win->mode == M_DIR)
+                        echdir("..", (dev_t)-1, NULL);
+                win->mode = M_DIR;
+                f_redraw = 1;
+                break;
+        case NAV_RIGHT:
+                if (win->nents == 0)
+                        break;
+                ent = entat(win->sel);
+                if (win->mode == M_GREP) {
+                        grepedit(ent);
+                        break;
+                }
+                if (ent->flags & ENT_MEMBER) {
+                        if (S_ISDIR(ent->stat.st_mode)) {
+                                snprintf(tarprefix + strlen(tarprefix),
+                                         sizeof(tarprefix) - strlen(tarprefix),
+                                         "%s/", ent->name);
+                                tarlist();
+                        } else if (S_ISREG(ent->stat.st_mode) &&
+                                   tarmember(ent, path, sizeof(path)) == 0) {
+                                tmp = *ent;
+                                tmp.name = path;
+                                openfile(&tmp);
+                        }
+                        break;
+                }
+                /* stat(2) follows links, so this covers links to dirs */
+                if (S_ISDIR(ent->stat.st_mode)) {
+                        echdir(ent->name, ent->stat.st_ino != 0 ?
+                               ent->stat.st_dev : (dev_t)-1, NULL);
+                        win->mode = M_DIR;
+                        f_redraw = 1;
+                } else if (S_ISREG(ent->stat.st_mode)) {
+                        if ((p = strrchr(ent->name, '.')) != NULL &&
+                            !strcasecmp(p, ".tar"))
+                                taropen(ent);
+                        else
+                                openfile(ent);
+                }
+                break;
+        case NAV_UP:
+                win->sel--;
+                break;
+        case NAV_DOWN:
+                win->sel++;
+                break;
+        case NAV_TOP:
+                win->sel = 0;
+                break;
+        case NAV_BOTTOM:
+                win->sel = win->nents - 1;
+                break;
+        case NAV_SELECT:
+                if (win->nents > 0)
+                        seltoggle(entat(win->sel++));
+                break;
+        case NAV_SHOWALL:
+                f_showall ^= 1;
+                f_redraw = 1;
+                break;
+        case NAV_INFO:
+                f_info ^= 1;
+                f_redraw = 1;
+                break;
+        case NAV_REDRAW:
+                f_redraw = 1;
+                break;
+        case NAV_EXIT:
+                f_running = 0;
+                break;
+        }
+}
+
+static void
+cd(const Arg *arg)
+{
+        /* results are relative to where the search started */
+        cmpcancel();
+        grepcancel();
+        echdir(arg->s, (dev_t)-1, NULL);
+        win->mode = M_DIR;
+        f_redraw = 1;
+}
+
+/*
+ * Run a command over the selection, or the entry under the cursor, the way
+ * xargs(1) does: file names go straight into argv, split into as many
+ * invocations as needed to stay under ARG_MAX.
+ */
+static void
+run(const Arg *arg)
+{
+        Selent *se;
+        char *cmd, *tok, **argv, **ep, desc[BUFSIZ], member[PATH_MAX];
+        long max;
+        size_t len, base = 0, n;
+        ulong i = 0, nfix = 0, nargv;
+        int fail = 0;
+
+        if (arg->s == NULL || win->nents == 0) {
+                notify(MSG_FAIL, NULL);
+                return;
+        }
+        if (selset.n > 0)
+                snprintf(desc, sizeof(desc), "%s <%lu selected>", arg->s,
+                         selset.n);
+        else
+                snprintf(desc, sizeof(desc), "%s %s", arg->s,
+                         entat(win->sel)->name);
+        f_noconfirm = 0;
+        if (!confirmact(desc))
+                return;
+
+        cmd = estrdup(arg->s);
+        argv = emalloc((strlen(cmd) / 2 + 2 + MAX(selset.n, 1)) *
+                       sizeof(char *));
+        for (tok = strtok(cmd, " \t"); tok; tok = strtok(NULL, " \t")) {
+                argv[nfix++] = tok;
+                base += strlen(tok) + 1 + sizeof(char *);
+        }
+        if (nfix == 0)
+                goto out;
+
+        if ((max = sysconf(_SC_ARG_MAX)) < _POSIX_ARG_MAX)
+                max = _POSIX_ARG_MAX;
+        max -= ARG_HEADROOM;
+        for (ep = environ; *ep != NULL; ep++)
+                base += strlen(*ep) + 1 + sizeof(char *);
+
+        nargv = nfix;
+        len = base;
+        if (selset.n == 0)
+                argv[nargv++] = entat(win->sel)->name;
+        /* archive members are handed over as extracted copies */
+        if (selset.n == 0 && entat(win->sel)->flags & ENT_MEMBER) {
+                if (tarmember(entat(win->sel), member, sizeof(member)))
+                        goto out;
+                argv[nargv - 1] = member;
+        }
+        for (; i < selset.cap; i++) {
+                if ((se = &selset.ents[i])->path == NULL)
+                        continue;
+                n = strlen(se->path) + 1 + sizeof(char *);
+                if (nargv > nfix && len + n > max) {
+                        argv[nargv] = NULL;
+                        fail |= spawnv(argv);
+                        nargv = nfix;
+                        len = base;
+                }
+                argv[nargv++] = se->path;
+                len += n;
+        }
+        if (nargv > nfix) {
+                argv[nargv] = NULL;
+                fail |= spawnv(argv);
+        }
+        selclear();
+        f_redraw = 1;
+        if (fail)
+                notify(MSG_FAIL, NULL);
+out:
+        free(argv);
+        free(cmd);
+}
+
+static void
+builtinrun(const Arg *arg)
+{
+        Arg prog;
+
+        switch (arg->n) {
+        case RUN_EDITOR:
+                prog.s = getenv(envs[ENV_EDITOR]);
+                break;
+        case RUN_PAGER:
+                prog.s = getenv(envs[ENV_PAGER]);
+                break;
+        case RUN_OPENWITH:
+                if ((prog.s = promptstr(msgs[MSG_OPENWITH])) == NULL)
+                        return;
+                run(&prog);
+                free((char *)prog.s);
+                return;
+        case RUN_RENAME:
+                bulkrename();
+                return;
+        default:
+                return;
+        }
+
+        run(&prog);
+}
+
+static int
+renamecmp(const void *x, const void *y)
+{
+        return strcmp((*(Rename **)x)->src, (*(Rename **)y)->src);
+}
+
+static int
+renamedstcmp(const void *x, const void *y)
+{
+        return strcmp((*(Rename **)x)->dst, (*(Rename **)y)->dst);
+}
+
+/* index of the rename whose source is name in the sorted byname[] */
+static long
+renamefind(Rename **byname, ulong n, const char *name)
+{
+        long lo = 0, hi = n - 1, mid;
+        int c;
+
+        while (lo <= hi) {
+                mid = lo + (hi - lo) / 2;
+                if ((c = strcmp(name, byname[mid]->src)) == 0)
+                        return mid;
+                if (c < 0)
+                        hi = mid - 1;
+                else
+                        lo = mid + 1;
+        }
+        return -1;
+}
+
+/* rename within dfd, never clobbering an existing name */
+static int
+renamenx(int dfd, const char *src, const char *dst)
+{
+#ifdef SYS_renameat2
+        if (syscall(SYS_renameat2, dfd, src, dfd, dst, RENAME_NOREPLACE) == 0)
+                return 0;
+        if (errno != EINVAL && errno != ENOSYS)
+                return -1;
+#endif /* SYS_renameat2 */
+        /* racy fallback for systems and file systems without renameat2 */
+        if (faccessat(dfd, dst, F_OK, AT_EACCESS) == 0) {
+                errno = EEXIST;
+                return -1;
+        }
+        return renameat(dfd, src, dfd, dst);
+}
+
+/*
+ * Apply renames[] so that no rename clobbers a name another one still has
+ * to move away: follow each chain of src -> dst to its free end and rename
+ * backwards from there. A chain that loops back on itself (a swap or a
+ * longer cycle) has its first source parked under a temporary name.
+ */
+static int
+renameplan(Rename *renames, ulong n, int dfd)
+{
+        Rename **byname, *r, *tail;
+        char tmp[64];
+        ulong i = 0, sp, *stack;
+        long j;
+        int k, ret = 0;
+
+        byname = emalloc(MAX(n, 1) * sizeof(Rename *));
+        stack = emalloc(MAX(n, 1) * sizeof(ulong));
+        for (; i < n; i++)
+                byname[i] = &renames[i];
+        qsort(byname, n, sizeof(Rename *), renamecmp);
+
+        for (i = 0; i < n && ret == 0; i++) {
+                if (renames[i].state != REN_TODO)
+                        continue;
+                sp = 0;
+                for (r = &renames[i];;) {
+                        r->state = REN_ACTIVE;
+                        stack[sp++] = r - renames;
+                        if ((j = renamefind(byname, n, r->dst)) < 0 ||
+                            byname[j]->state == REN_DONE)
+                                break;
+                        r = byname[j];
+                        if (r->state != REN_ACTIVE)
+                                continue;
+                        /* cycle, park the source that started it */
+                        for (k = 0;; k++) {
+                                snprintf(tmp, sizeof(tmp), ".sfm-rename.%d.%d",
+                                         (int)getpid(), k);
+                                if (renamenx(dfd, r->src, tmp) == 0)
+                                        break;
+                                if (errno != EEXIST) {
+                                        ret = -1;
+                                        break;
+                                }
+                        }
+                        if (ret == 0) {
+                                free(r->src);
+                                r->src = estrdup(tmp);
+                        }
+                        break;
+                }
+                while (sp > 0 && ret == 0) {
+                        tail = &renames[stack[--sp]];
+                        if (renamenx(dfd, tail->src, tail->dst) != 0)
+                                ret = -1;
+                        else
+                                tail->state = REN_DONE;
+                }
+        }
+        free(stack);
+        free(byname);
+
+        return ret;
+}
+
+/*
+ * Edit the names of the selection (or the entry under the cursor) in
+ * $EDITOR and rename them in place, without rescanning the directory.
+ */
+static void
+bulkrename(void)
+{
+        Rename *renames = NULL, **bydst;
+        Selent *se;
+        Entry *ent, tmp;
+        FILE *fp;
+        char path[PATH_MAX], *line = NULL, *editor, *argv[3];
+        const char *tmpdir, *name;
+        size_t cap = 0;
+        ssize_t len;
+        ulong i, n = 0, ncap = 1, nlines = 0, nren = 0, *ents;
+        int fd, dfd, bad = 0, ok = 0;
+
+        if (win->nents == 0)
+                return;
+        /* virtual listings don't name files in the cwd */
+        if (win->mode != M_DIR) {
+                notify(MSG_FAIL, NULL);
+                return;
+        }
+        ents = emalloc(sizeof(ulong));
+        for (i = 0; selset.n > 0 && i < win->nents; i++) {
+                if (!selhas(entat(i)))
+                        continue;
+                if (n == ncap) {
+                        ncap *= 2;
+                        if ((ents = realloc(ents, ncap * sizeof(ulong))) ==
+                            NULL)
+                                die("realloc:");
+                }
+                ents[n++] = i;
+        }
+        if (n == 0)
+                ents[n++] = win->sel;
+
+        if ((tmpdir = getenv("TMPDIR")) == NULL)
+                tmpdir = "/tmp";
+        snprintf(path, sizeof(path), "%s/sfm.XXXXXX", tmpdir);
+        if ((fd = mkstemp(path)) < 0) {
+                free(ents);
+                notify(MSG_FAIL, NULL);
+                return;
+        }
+        if ((fp = fdopen(fd, "w")) == NULL) {
+                close(fd);
+                goto out;
+        }
+        for (i = 0; i < n; i++)
+                if (strchr(entat(ents[i])->name, '\n') == NULL)
+                        fprintf(fp, "%s\n", entat(ents[i])->name);
+                else
+                        bad = 1;
+        if (fclose(fp) != 0 || bad)
+                goto out;
+
+        editor = getenv(envs[ENV_EDITOR]);
+        argv[0] = editor != NULL ? editor : "vi";
+        argv[1] = path;
+        argv[2] = NULL;
+        if (spawnv(argv) || (fp = fopen(path, "r")) == NULL)
+                goto out;
+
+        renames = emalloc(n * sizeof(Rename));
+        while (!bad && (len = getline(&line, &cap, fp)) >= 0) {
+                if (len > 0 && line[len - 1] == '\n')
+                        line[--len] = '\0';
+                if (nlines++ >= n)
+                        continue;
+                ent = entat(ents[nlines - 1]);
+                if (!strcmp(line, ent->name))
+                        continue;
+                if (len == 0 || strchr(line, '/') != NULL ||
+                    !strcmp(line, ".") || !strcmp(line, "..")) {
+                        bad = 1;
+                        break;
+                }
+                renames[nren].src = estrdup(ent->name);
+                renames[nren].dst = estrdup(line);
+                renames[nren].ent = ents[nlines - 1];
+                renames[nren++].state = REN_TODO;
+        }
+        free(line);
+        fclose(fp);
+
+        /* two entries can't end up with the same name */
+        bydst = emalloc(MAX(nren, 1) * sizeof(Rename *));
+        for (i = 0; i < nren; i++)
+                bydst[i] = &renames[i];
+        qsort(bydst, nren, sizeof(Rename *), renamedstcmp);
+        for (i = 1; i < nren; i++)
+                if (!strcmp(bydst[i - 1]->dst, bydst[i]->dst))
+                        bad = 1;
+        free(bydst);
+
+        if (bad || nlines != n) {
+                notify(bad ? MSG_RENAME : MSG_RENAMEN, NULL);
+                xdelay(DELAY_MS << 2);
+                ok = 1;
+                goto out;
+        }
+
+        if ((dfd = open(".", O_RDONLY | O_DIRECTORY)) < 0)
+                goto out;
+        ok = renameplan(renames, nren, dfd) == 0;
+        close(dfd);
+
+        /* update the listing and the selection in place */
+        for (i = 0; i < nren; i++) {
+                name = renames[i].state == REN_DONE ? renames[i].dst :
+                       renames[i].src;
+                if (win->big != NULL) {
+                        /* spilled names are left to the reload below */
+                        ent = &tmp;
+                        tmp.name = (char *)name;
+                        tmp.nlen = strlen(name);
+                        if (stat(name, &tmp.stat) != 0)
+                                continue;
+                } else {
+                        ent = &win->ents[renames[i].ent];
+                        if (!strcmp(ent->name, name))
+                                continue;
+                        free(ent->name);
+                        ent->name = estrdup(name);
+                        ent->nlen = strlen(name);
+                }
+                if (selset.n > 0 && (se = selfind(ent->stat.st_dev,
+                    ent->stat.st_ino))->path != NULL) {
+                        free(se->path);
+                        se->path = selpath(ent);
+                }
+        }
+        if (win->big != NULL)
+                f_redraw = 1;
+        else
+                ENTSORT(win->ents, win->nents);
+out:
+        for (i = 0; i < nren; i++) {
+                free(renames[i].src);
+                free(renames[i].dst);
+        }
+        free(renames);
+        unlink(path);
+        free(ents);
+        if (!ok) {
+                notify(MSG_FAIL, NULL);
+                xdelay(DELAY_MS << 2);
+        }
+}
+
+#define HASH_P1 11400714785074694791ULL
+#define HASH_P2 14029467366897019727ULL
+#define HASH_P3 1609587929392839161ULL
+#define HASH_P4 9650029242287828579ULL
+#define HASH_P5 2870177450012600261ULL
+#define ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static inline ull
+hashround(ull acc, ull in)
+{
+        acc += in * HASH_P2;
+        return ROTL64(acc, 31) * HASH_P1;
+}
+
+static inline ull
+hashmerge(ull acc, ull v)
+{
+        acc ^= hashround(0, v);
+        return acc * HASH_P1 + HASH_P4;
+}
+
+static inline ull
+hashread64(const uchar *p)
+{
+        ull v;
+
+        memcpy(&v, p, sizeof(v));
+        return v;
+}
+
+static void
+hashinit(Hash *h, ull seed)
+{
+        h->v[0] = seed + HASH_P1 + HASH_P2;
+        h->v[1] = seed + HASH_P2;
+        h->v[2] = seed;
+        h->v[3] = seed - HASH_P1;
+        h->total = 0;
+        h->nbuf = 0;
+}
+
+static void
+hashupdate(Hash *h, const void *data, size_t len)
+{
+        const uchar *p = data, *end = p + len;
+        ull v0, v1, v2, v3;
+        size_t n;
+
+        h->total += len;
+        if (h->nbuf > 0) {
+                n = MIN(len, sizeof(h->buf) - h->nbuf);
+                memcpy(h->buf + h->nbuf, p, n);
+                h->nbuf += n;
+                p += n;
+                if (h->nbuf < sizeof(h->buf))
+                        return;
+                h->v[0] = hashround(h->v[0], hashread64(h->buf));
+                h->v[1] = hashround(h->v[1], hashread64(h->buf + 8));
+                h->v[2] = hashround(h->v[2], hashread64(h->buf + 16));
+                h->v[3] = hashround(h->v[3], hashread64(h->buf + 24));
+                h->nbuf = 0;
+        }
+
+        /* the lanes don't depend on each other, keep them in registers */
+        v0 = h->v[0];
+        v1 = h->v[1];
+        v2 = h->v[2];
+        v3 = h->v[3];
+        for (; end - p >= 32; p += 32) {
+                v0 = hashround(v0, hashread64(p));
+                v1 = hashround(v1, hashread64(p + 8));
+                v2 = hashround(v2, hashread64(p + 16));
+                v3 = hashround(v3, hashread64(p + 24));
+        }
+        h->v[0] = v0;
+        h->v[1] = v1;
+        h->v[2] = v2;
+        h->v[3] = v3;
+
+        memcpy(h->buf, p, end - p);
+        h->nbuf = end - p;
+}
+
+static ull
+hashfinal(Hash *h)
+{
+        const uchar *p = h->buf, *end = p + h->nbuf;
+        ull acc;
+        uint k;
+        int i = 0;
+
+        if (h->total >= 32) {
+                acc = ROTL64(h->v[0], 1) + ROTL64(h->v[1], 7) +
+                      ROTL64(h->v[2], 12) + ROTL64(h->v[3], 18);
+                for (; i < 4; i++)
+                        acc = hashmerge(acc, h->v[i]);
+        } else {
+                acc = h->v[2] + HASH_P5;
+        }
+        acc += h->total;
+
+        for (; end - p >= 8; p += 8) {
+                acc ^= hashround(0, hashread64(p));
+                acc = ROTL64(acc, 27) * HASH_P1 + HASH_P4;
+        }
+        if (end - p >= 4) {
+                memcpy(&k, p, sizeof(k));
+                acc ^= (ull)k * HASH_P1;
+                acc = ROTL64(acc, 23) * HASH_P2 + HASH_P3;
+                p += 4;
+        }
+        for (; p < end; p++) {
+                acc ^= *p * HASH_P5;
+                acc = ROTL64(acc, 11) * HASH_P1;
+        }
+
+        acc ^= acc >> 33;
+        acc *= HASH_P2;
+        acc ^= acc >> 29;
+        acc *= HASH_P3;
+        acc ^= acc >> 32;
+
+        return acc;
+}
+
+static void *
+parworker(void *arg)
+{
+        Par *par = arg;
+        uchar *buf;
+        ulong i;
+
+        PERF_THREAD("pool");
+        buf = emalloc(PARBUF);
+        while ((i = __atomic_fetch_add(&par->next, 1, __ATOMIC_RELAXED)) <
+               par->n)
+                par->fn(par->ctx, i, buf);
+        free(buf);
+
+        return NULL;
+}
+
+/* call fn(ctx, i, buf) for every i < n on all cores, buf is per thread */
+static void
+parallel(ulong n, void (*fn)(void *, ulong, uchar *), void *ctx)
+{
+        Par par = {fn, ctx, n, 0};
+        pthread_t th[PARMAX];
+        long ncpu;
+        int i = 0, nth;
+
+        if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+                ncpu = 1;
+        nth = MIN(MIN(ncpu, PARMAX), MAX(n, 1));
+        for (; i < nth - 1; i++)
+                if (pthread_create(&th[i], NULL, parworker, &par) != 0)
+                        break;
+        parworker(&par);
+        while (i-- > 0)
+                pthread_join(th[i], NULL);
+}
+
+static int
+dupinocmp(const void *x, const void *y)
+{
+        const Dupfile *a = x, *b = y;
+
+        if (a->dev != b->dev)
+                return a->dev < b->dev ? -1 : 1;
+        if (a->ino != b->ino)
+                return a->ino < b->ino ? -1 : 1;
+        return 0;
+}
+
+static int
+duphashcmp(const void *x, const void *y)
+{
+        const Dupfile *a = x, *b = y;
+
+        if (a->size != b->size)
+                return a->size < b->size ? -1 : 1;
+        if (a->hash != b->hash)
+                return a->hash < b->hash ? -1 : 1;
+        return 0;
+}
+
+/* biggest savings first, then keep each group together */
+static int
+dupgroupcmp(const void *x, const void *y)
+{
+        const Dupfile *a = x, *b = y;
+
+        if (a->reclaim != b->reclaim)
+                return a->reclaim > b->reclaim ? -1 : 1;
+        if (a->group != b->group)
+                return a->group < b->group ? -1 : 1;
+        return strcmp(a->path, b->path);
+}
+
+static int
+dupwalk(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+        Dupjob *dj = dupcur;
+        Dupfile *f;
+
+        if (dj->cancel)
+                return 1;
+        if (type != FTW_F || !S_ISREG(st->st_mode) || st->st_size == 0)
+                return 0;
+        if (dj->n == dj->cap) {
+                dj->cap = MAX(dj->cap * 2, 1024);
+                if ((dj->files = realloc(dj->files,
+                    dj->cap * sizeof(Dupfile))) == NULL)
+                        die("realloc:");
+        }
+        if (!strncmp(path, "./", 2))
+                path += 2;
+        f = &dj->files[dj->n];
+        f->path = estrdup(path);
+        f->size = st->st_size;
+        f->dev = st->st_dev;
+        f->ino = st->st_ino;
+        f->mode = st->st_mode;
+        f->ctime = st->st_ctime;
+        f->hash = 0;
+        f->bad = 0;
+        __atomic_store_n(&dj->n, dj->n + 1, __ATOMIC_RELAXED);
+
+        return 0;
+}
+
+/* head and tail block, enough to tell most same-sized files apart */
+static void
+duphash(void *ctx, ulong i, uchar *buf)
+{
+        Dupjob *dj = ctx;
+        Dupfile *f = &dj->files[i];
+        Hash h;
+        ssize_t n;
+        int fd;
+
+        if (dj->cancel || (fd = open(f->path, O_RDONLY)) < 0) {
+                f->bad = 1;
+                return;
+        }
+        hashinit(&h, 0);
+        if ((n = pread(fd, buf, DUPBLOCK, 0)) > 0)
+                hashupdate(&h, buf, n);
+        if (f->size > DUPBLOCK &&
+            (n = pread(fd, buf, DUPBLOCK, f->size - DUPBLOCK)) > 0)
+                hashupdate(&h, buf, n);
+        f->bad = n < 0;
+        f->hash = hashfinal(&h);
+        close(fd);
+        __atomic_fetch_add(&dj->nhashed, 1, __ATOMIC_RELAXED);
+}
+
+static void
+duphashfull(void *ctx, ulong i, uchar *buf)
+{
+        Dupjob *dj = ctx;
+        Dupfile *f = &dj->files[i];
+        Hash h;
+        ssize_t n;
+        int fd;
+
+        if (dj->cancel || (fd = open(f->path, O_RDONLY)) < 0) {
+                f->bad = 1;
+                return;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif /* POSIX_FADV_SEQUENTIAL */
+        hashinit(&h, 0);
+        while ((n = read(fd, buf, PARBUF)) > 0 && !dj->cancel)
+                hashupdate(&h, buf, n);
+        f->bad = n != 0;
+        f->hash = hashfinal(&h);
+        close(fd);
+        __atomic_fetch_add(&dj->nhashed, 1, __ATOMIC_RELAXED);
+}
+
+/* hashes can collide, so each file is compared with the first of its run */
+static void
+dupverify(void *ctx, ulong i, uchar *buf)
+{
+        Dupjob *dj = ctx;
+        Dupfile *f = &dj->files[i];
+
+        if (dj->cancel || (f->ref != i &&
+            cmpdata(dj->files[f->ref].path, f->path, f->size, buf)))
+                f->bad = 1;
+        __atomic_fetch_add(&dj->nhashed, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Sort by (size, hash) and keep only runs of two or more readable files.
+ * With group set, number the runs and note what each one would reclaim.
+ */
+static void
+dupkeep(Dupjob *dj, int group)
+{
+        Dupfile *f = dj->files;
+        ulong i = 0, j, k, good, n = 0, ngroups = 0;
+
+        qsort(f, dj->n, sizeof(Dupfile), duphashcmp);
+        while (i < dj->n) {
+                for (j = i, good = 0; j < dj->n && !duphashcmp(&f[i], &f[j]);
+                     j++)
+                        good += !f[j].bad;
+                for (k = i; k < j; k++) {
+                        if (good < 2 || f[k].bad) {
+                                free(f[k].path);
+                                continue;
+                        }
+                        f[n] = f[k];
+                        if (group) {
+                                f[n].group = ngroups;
+                                f[n].reclaim = (ull)f[k].size * (good - 1);
+                        }
+                        n++;
+                }
+                ngroups++;
+                i = j;
+        }
+        dj->n = n;
+}
+
+static void
+dupput(Dupjob *dj)
+{
+        ulong i = 0;
+
+        if (__atomic_sub_fetch(&dj->refs, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+        for (; i < dj->n; i++)
+                free(dj->files[i].path);
+        for (i = 0; i < dj->nroots; i++)
+                free(dj->roots[i]);
+        free(dj->roots);
+        free(dj->files);
+        free(dj);
+}
+
+static void *
+dupscan(void *arg)
+{
+        Dupjob *dj = arg;
+        ulong i = 0, n = 0, g = 0;
+
+        PERF_THREAD("dupscan");
+        dupcur = dj;
+        for (; i < dj->nroots && !dj->cancel; i++)
+                nftw(dj->roots[i], dupwalk, 32, FTW_PHYS);
+        dupcur = NULL;
+
+        /* hard links of one inode don't take up space twice */
+        qsort(dj->files, dj->n, sizeof(Dupfile), dupinocmp);
+        for (i = 0; i < dj->n; i++) {
+                if (n > 0 && !dupinocmp(&dj->files[n - 1], &dj->files[i]))
+                        free(dj->files[i].path);
+                else
+                        dj->files[n++] = dj->files[i];
+        }
+        dj->n = n;
+
+        /* same size, then same head and tail, then same contents */
+        dupkeep(dj, 0);
+        dj->ntohash = dj->n;
+        parallel(dj->n, duphash, dj);
+        dupkeep(dj, 0);
+        dj->nhashed = 0;
+        dj->ntohash = dj->n;
+        parallel(dj->n, duphashfull, dj);
+        dupkeep(dj, 0);
+        for (i = 0; i < dj->n; i++)
+                dj->files[i].ref = i > 0 && !duphashcmp(&dj->files[i - 1],
+                    &dj->files[i]) ? dj->files[i - 1].ref : i;
+        dj->nhashed = 0;
+        dj->ntohash = dj->n;
+        parallel(dj->n, dupverify, dj);
+        dupkeep(dj, 1);
+        qsort(dj->files, dj->n, sizeof(Dupfile), dupgroupcmp);
+        for (i = 0, n = 0; i < dj->n; i++) {
+                if (i > 0 && dj->files[i].group != g)
+                        n++;
+                g = dj->files[i].group;
+                dj->files[i].group = n;
+        }
+
+        __atomic_store_n(&dj->done, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&f_dupbusy, 0, __ATOMIC_RELEASE);
+        dupput(dj);
+
+        return NULL;
+}
+
+/* find duplicates under the selection, or the current directory */
+static void
+dupfind(const Arg *arg)
+{
+        Dupjob *dj;
+        Dupfile *f;
+        Entry *ents;
+        Selent *se;
+        struct stat st;
+        pthread_t th;
+        char buf[BUFSIZ];
+        ulong i = 0;
+
+        if (__atomic_load_n(&f_dupbusy, __ATOMIC_ACQUIRE)) {
+                notify(MSG_BUSY, NULL);
+                return;
+        }
+        if ((dj = calloc(1, sizeof(Dupjob))) == NULL)
+                die("calloc:");
+        dj->refs = 2;
+        dj->roots = emalloc(MAX(selset.n, 1) * sizeof(char *));
+        for (; i < selset.cap && selset.n > 0; i++)
+                if ((se = &selset.ents[i])->path != NULL)
+                        dj->roots[dj->nroots++] = estrdup(se->path);
+        if (dj->nroots == 0)
+                dj->roots[dj->nroots++] = estrdup(".");
+
+        f_dupbusy = 1;
+        if (pthread_create(&th, NULL, dupscan, dj) != 0)
+                die("pthread_create:");
+        pthread_detach(th);
+
+        /* stay responsive while the scan runs, ESC abandons it */
+        timeout(100);
+        while (!__atomic_load_n(&dj->done, __ATOMIC_ACQUIRE)) {
+                snprintf(buf, sizeof(buf), msgs[MSG_DUPSCAN],
+                         __atomic_load_n(&dj->n, __ATOMIC_RELAXED),
+                         __atomic_load_n(&dj->nhashed, __ATOMIC_RELAXED),
+                         dj->ntohash);
+                notify(-1, buf);
+                if (getch() == ESC) {
+                        dj->cancel = 1;
+                        timeout(-1);
+                        dupput(dj);
+                        return;
+                }
+        }
+        timeout(-1);
+
+        if (dj->n == 0) {
+                notify(MSG_DUPNONE, NULL);
+                xdelay(DELAY_MS << 1);
+                dupput(dj);
+                return;
+        }
+        ents = emalloc(dj->n * sizeof(Entry));
+        for (i = 0; i < dj->n; i++) {
+                f = &dj->files[i];
+                memset(&st, 0, sizeof(st));
+                st.st_mode = f->mode;
+                st.st_size = f->size;
+                st.st_dev = f->dev;
+                st.st_ino = f->ino;
+                st.st_ctime = f->ctime;
+                entfill(&ents[i], f->path, DT_REG, &st);
+                ents[i].aux = emalloc(24);
+                snprintf(ents[i].aux, 24, "#%-4lu %6s", f->group + 1,
+                         fmtsize(f->reclaim));
+        }
+        entcleanup();
+        win->ents = ents;
+        win->nents = dj->n;
+        win->sel = 0;
+        win->mode = M_DUPS;
+        dupput(dj);
+}
+
+static int
+strptrcmp(const void *x, const void *y)
+{
+        return strcmp(*(char *const *)x, *(char *const *)y);
+}
+
+static void
+cmpput(Cmpjob *cj)
+{
+        ulong i = 0;
+
+        if (__atomic_sub_fetch(&cj->refs, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+        for (; i < cj->nq; i++)
+                free(cj->queue[i]);
+        for (i = 0; i < cj->n; i++)
+                free(cj->res[i].path);
+        free(cj->queue);
+        free(cj->res);
+        pthread_mutex_destroy(&cj->lock);
+        pthread_cond_destroy(&cj->cond);
+        free(cj);
+}
+
+static void
+cmpemit(Cmpjob *cj, const char *path, const struct stat *st, int what)
+{
+        Cmpres *r;
+
+        pthread_mutex_lock(&cj->lock);
+        if (cj->n == cj->cap) {
+                cj->cap = MAX(cj->cap * 2, 256);
+                if ((cj->res = realloc(cj->res, cj->cap * sizeof(Cmpres))) ==
+                    NULL)
+                        die("realloc:");
+        }
+        r = &cj->res[cj->n++];
+        r->path = estrdup(path);
+        r->st = *st;
+        r->what = what;
+        pthread_mutex_unlock(&cj->lock);
+}
+
+/* sorted names in a directory, NULL if it can't be read */
+static char **
+cmpread(const char *path, ulong *n)
+{
+        DIR *dp;
+        struct dirent *de;
+        char **names = NULL;
+        ulong cap = 0;
+
+        *n = 0;
+        if ((dp = opendir(path)) == NULL)
+                return NULL;
+        while ((de = readdir(dp)) != NULL) {
+                if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                        continue;
+                if (*n == cap) {
+                        cap = MAX(cap * 2, 64);
+                        if ((names = realloc(names, cap * sizeof(char *))) ==
+                            NULL)
+                                die("realloc:");
+                }
+                names[(*n)++] = estrdup(de->d_name);
+        }
+        closedir(dp);
+        qsort(names, *n, sizeof(char *), strptrcmp);
+
+        return names;
+}
+
+/* 1 if two files of size bytes differ, stops at the first differing chunk */
+static int
+cmpdata(const char *a, const char *b, off_t size, uchar *buf)
+{
+        uchar *bufb = buf + PARBUF / 2;
+        ssize_t na = 0, nb = 0;
+        off_t off = 0;
+        int fa, fb, diff = 1;
+
+        if ((fa = open(a, O_RDONLY)) < 0)
+                return 1;
+        if ((fb = open(b, O_RDONLY)) < 0) {
+                close(fa);
+                return 1;
+        }
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fa, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(fb, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif /* POSIX_FADV_SEQUENTIAL */
+        while (off < size) {
+                na = pread(fa, buf, PARBUF / 2, off);
+                nb = pread(fb, bufb, PARBUF / 2, off);
+                if (na <= 0 || na != nb || memcmp(buf, bufb, na) != 0)
+                        break;
+                off += na;
+        }
+        diff = off < size;
+        close(fa);
+        close(fb);
+
+        return diff;
+}
+
+/* classify a name both sides have, 1 if it's a directory to descend */
+static int
+cmpentry(Cmpjob *cj, const char *rel, const char *name,
+         const struct stat *l, const struct stat *r, uchar *buf)
+{
+        char a[PATH_MAX], b[PATH_MAX], la[PATH_MAX], lb[PATH_MAX];
+        ssize_t na, nb;
+        int what = -1;
+
+        if (snprintf(a, sizeof(a), "%s/%s%s", cj->roots[0], rel, name) >=
+            sizeof(a) || snprintf(b, sizeof(b), "%s/%s%s", cj->roots[1], rel,
+            name) >= sizeof(b))
+                return 0;
+        if ((l->st_mode & S_IFMT) != (r->st_mode & S_IFMT)) {
+                what = CMP_TYPE;
+        } else if (S_ISREG(l->st_mode)) {
+                if (l->st_size != r->st_size ||
+                    (cj->data && cmpdata(a, b, l->st_size, buf)))
+                        what = CMP_DATA;
+        } else if (S_ISLNK(l->st_mode)) {
+                na = readlink(a, la, sizeof(la));
+                nb = readlink(b, lb, sizeof(lb));
+                if (na != nb || na < 0 || memcmp(la, lb, na) != 0)
+                        what = CMP_DATA;
+        }
+        /* a directory's mtime changes with any entry, that's no news */
+        if (what < 0 && (l->st_mode != r->st_mode ||
+            l->st_uid != r->st_uid || l->st_gid != r->st_gid ||
+            (!S_ISDIR(l->st_mode) && !S_ISLNK(l->st_mode) &&
+             l->st_mtime != r->st_mtime)))
+                what = CMP_META;
+        if (what >= 0) {
+                snprintf(a, sizeof(a), "%s%s", rel, name);
+                cmpemit(cj, a, r, what);
+        }
+
+        return what != CMP_TYPE && S_ISDIR(l->st_mode);
+}
+
+/* merge the sorted listings of rel on both sides */
+static void
+cmpdir(Cmpjob *cj, const char *rel, uchar *buf)
+{
+        struct stat st[2];
+        char path[PATH_MAX], **names[2], *sub;
+        ulong n[2], i = 0, j = 0, k;
+        int c, fd[2], s = 0;
+
+        for (; s < 2; s++) {
+                snprintf(path, sizeof(path), "%s/%s", cj->roots[s], rel);
+                names[s] = cmpread(path, &n[s]);
+                fd[s] = open(path, O_RDONLY | O_DIRECTORY);
+        }
+        while ((i < n[0] || j < n[1]) &&
+               !__atomic_load_n(&cj->cancel, __ATOMIC_RELAXED)) {
+                if (i == n[0])
+                        c = 1;
+                else if (j == n[1])
+                        c = -1;
+                else
+                        c = strcmp(names[0][i], names[1][j]);
+                snprintf(path, sizeof(path), "%s%s", rel,
+                         c <= 0 ? names[0][i] : names[1][j]);
+                if (c < 0) {
+                        if (fstatat(fd[0], names[0][i++], &st[0],
+                            AT_SYMLINK_NOFOLLOW) == 0)
+                                cmpemit(cj, path, &st[0], CMP_REMOVED);
+                        continue;
+                }
+                if (c > 0) {
+                        if (fstatat(fd[1], names[1][j++], &st[1],
+                            AT_SYMLINK_NOFOLLOW) == 0)
+                                cmpemit(cj, path, &st[1], CMP_ADDED);
+                        continue;
+                }
+                if (fstatat(fd[0], names[0][i], &st[0],
+                    AT_SYMLINK_NOFOLLOW) == 0 && fstatat(fd[1], names[1][j],
+                    &st[1], AT_SYMLINK_NOFOLLOW) == 0 &&
+                    cmpentry(cj, rel, names[0][i], &st[0], &st[1], buf)) {
+                        sub = emalloc(strlen(path) + 2);
+                        sprintf(sub, "%s/", path);
+                        pthread_mutex_lock(&cj->lock);
+                        if (cj->nq == cj->capq) {
+                                cj->capq = MAX(cj->capq * 2, 64);
+                                if ((cj->queue = realloc(cj->queue, cj->capq *
+                                    sizeof(char *))) == NULL)
+                                        die("realloc:");
+                        }
+                        cj->queue[cj->nq++] = sub;
+                        pthread_cond_signal(&cj->cond);
+                        pthread_mutex_unlock(&cj->lock);
+                }
+                i++;
+                j++;
+        }
+        for (s = 0; s < 2; s++) {
+                for (k = 0; k < n[s]; k++)
+                        free(names[s][k]);
+                free(names[s]);
+                if (fd[s] >= 0)
+                        close(fd[s]);
+        }
+        __atomic_fetch_add(&cj->ndirs, 1, __ATOMIC_RELAXED);
+}
+
+static void *
+cmpworker(void *arg)
+{
+        Cmpjob *cj = arg;
+        uchar *buf;
+        char *rel;
+
+        PERF_THREAD("cmp");
+        buf = emalloc(PARBUF);
+        pthread_mutex_lock(&cj->lock);
+        for (;;) {
+                while (cj->nq == 0 && !cj->done && !cj->cancel) {
+                        if (++cj->idle == cj->nth) {
+                                /* nobody left to queue anything */
+                                cj->done = 1;
+                                pthread_cond_broadcast(&cj->cond);
+                        } else {
+                                pthread_cond_wait(&cj->cond, &cj->lock);
+                        }
+                        cj->idle--;
+                }
+                if (cj->done || cj->cancel)
+                        break;
+                rel = cj->queue[--cj->nq];
+                pthread_mutex_unlock(&cj->lock);
+                cmpdir(cj, rel, buf);
+                free(rel);
+                pthread_mutex_lock(&cj->lock);
+        }
+        pthread_mutex_unlock(&cj->lock);
+        free(buf);
+        cmpput(cj);
+
+        return NULL;
+}
+
+/* stop comparing, the workers let go of the job when they notice */
+static void
+cmpcancel(void)
+{
+        if (curcmp == NULL)
+                return;
+        pthread_mutex_lock(&curcmp->lock);
+        curcmp->cancel = 1;
+        pthread_cond_broadcast(&curcmp->cond);
+        pthread_mutex_unlock(&curcmp->lock);
+        cmpput(curcmp);
+        curcmp = NULL;
+}
+
+/* move new results into the listing, called before every redraw */
+static void
+cmpsync(void)
+{
+        Cmpres *r;
+        char *name = NULL, path[PATH_MAX];
+        ulong i;
+        uchar done;
+
+        if (curcmp == NULL)
+                return;
+        /* the listing is gone, so is the point of comparing */
+        if (win->mode != M_CMP) {
+                cmpcancel();
+                return;
+        }
+
+        pthread_mutex_lock(&curcmp->lock);
+        if (curcmp->n > win->nents) {
+                if ((win->ents = realloc(win->ents, curcmp->n *
+                    sizeof(Entry))) == NULL)
+                        die("realloc:");
+                for (i = win->nents; i < curcmp->n; i++) {
+                        r = &curcmp->res[i];
+                        /* names are relative to the current directory */
+                        if (r->what != CMP_ADDED || snprintf(path,
+                            sizeof(path), "%s/%s", curcmp->roots[1],
+                            r->path) >= sizeof(path))
+                                snprintf(path, sizeof(path), "%s", r->path);
+                        entfill(&win->ents[i], path, S_ISDIR(r->st.st_mode) ?
+                                DT_DIR : DT_REG, &r->st);
+                        win->ents[i].aux = emalloc(8);
+                        snprintf(win->ents[i].aux, 8, "%-7s",
+                                 cmpnames[r->what]);
+                        win->ents[i].auxcolor = cmpcolors[r->what];
+                }
+                win->nents = curcmp->n;
+        }
+        done = curcmp->done;
+        snprintf(winlabel, sizeof(winlabel), ": %s, %lu dirs%s",
+                 curcmp->roots[1], curcmp->ndirs, done ? "" : "...");
+        pthread_mutex_unlock(&curcmp->lock);
+        if (!done)
+                return;
+
+        /* results came in walk order, sort them keeping the cursor */
+        if (win->nents > 0)
+                name = estrdup(win->ents[win->sel].name);
+        ENTSORT(win->ents, win->nents);
+        for (i = 0; name != NULL && i < win->nents; i++)
+                if (!strcmp(win->ents[i].name, name))
+                        win->sel = i;
+        free(name);
+        cmpput(curcmp);
+        curcmp = NULL;
+}
+
+/* compare the current directory with a prompted one */
+static void
+cmpstart(const Arg *arg)
+{
+        Cmpjob *cj;
+        pthread_t th;
+        char *str;
+        long ncpu;
+        int i = 0;
+
+        if (curcmp != NULL) {
+                notify(MSG_BUSY, NULL);
+                return;
+        }
+        if ((str = promptstr(msgs[MSG_CMPWITH])) == NULL)
+                return;
+        if ((cj = calloc(1, sizeof(Cmpjob))) == NULL)
+                die("calloc:");
+        if (realpath(".", cj->roots[0]) == NULL ||
+            realpath(str, cj->roots[1]) == NULL) {
+                free(str);
+                free(cj);
+                notify(MSG_FAIL, NULL);
+                return;
+        }
+        free(str);
+        notify(MSG_CMPDATA, NULL);
+        cj->data = getch() == 'y';
+
+        pthread_mutex_init(&cj->lock, NULL);
+        pthread_cond_init(&cj->cond, NULL);
+        cj->queue = emalloc(sizeof(char *));
+        cj->queue[cj->nq++] = estrdup("");
+        cj->capq = 1;
+        if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+                ncpu = 1;
+        cj->nth = MIN(ncpu, PARMAX);
+        cj->refs = cj->nth + 1;
+        pthread_mutex_lock(&cj->lock);
+        for (; i < cj->nth; i++) {
+                if (pthread_create(&th, NULL, cmpworker, cj) != 0)
+                        die("pthread_create:");
+                pthread_detach(th);
+        }
+        pthread_mutex_unlock(&cj->lock);
+
+        entcleanup();
+        win->nents = 0;
+        win->sel = 0;
+        win->mode = M_CMP;
+        curcmp = cj;
+        cmpsync();
+}
+
+/* read the ignore files of dir on top of the chain up */
+static Ignore *
+ignload(Ignore *up, int dfd, const char *dir)
+{
+        static const char *files[] = {".gitignore", ".ignore"};
+        Ignore *ig = NULL;
+        Ignpat *ip;
+        FILE *fp;
+        char path[PATH_MAX], line[BUFSIZ], *p;
+        size_t len;
+        int i = 0, fd;
+
+        for (; i < ARRLEN(files); i++) {
+                if (snprintf(path, sizeof(path), "%s%s", *dir ? dir : "./",
+                    files[i]) >= sizeof(path) ||
+                    (fd = openat(dfd, path, O_RDONLY)) < 0)
+                        continue;
+                if ((fp = fdopen(fd, "r")) == NULL) {
+                        close(fd);
+                        continue;
+                }
+                if (ig == NULL) {
+                        ig = emalloc(sizeof(Ignore));
+                        ig->up = up;
+                        ig->dir = estrdup(dir);
+                        ig->pats = NULL;
+                        ig->n = 0;
+                        ig->refs = 1;
+                }
+                while (fgets(line, sizeof(line), fp) != NULL) {
+                        line[strcspn(line, "\r\n")] = '\0';
+                        p = line;
+                        if (*p == '\0' || *p == '#')
+                                continue;
+                        if ((ig->n & (ig->n - 1)) == 0 &&
+                            (ig->pats = realloc(ig->pats, MAX(ig->n * 2, 1) *
+                            sizeof(Ignpat))) == NULL)
+                                die("realloc:");
+                        ip = &ig->pats[ig->n++];
+                        if ((ip->neg = *p == '!'))
+                                p++;
+                        len = strlen(p);
+                        if ((ip->dironly = len > 1 && p[len - 1] == '/'))
+                                p[--len] = '\0';
+                        ip->anchored = strchr(p, '/') != NULL;
+                        if (*p == '/')
+                                p++;
+                        ip->pat = estrdup(p);
+                }
+                fclose(fp);
+        }
+        /* a new reference either way, to ig or to up */
+        if (up != NULL)
+                __atomic_add_fetch(&up->refs, 1, __ATOMIC_RELAXED);
+
+        return ig != NULL ? ig : up;
+}
+
+static void
+ignput(Ignore *ig)
+{
+        Ignore *up;
+        ulong i;
+
+        for (; ig != NULL; ig = up) {
+                if (__atomic_sub_fetch(&ig->refs, 1, __ATOMIC_ACQ_REL) > 0)
+                        return;
+                up = ig->up;
+                for (i = 0; i < ig->n; i++)
+                        free(ig->pats[i].pat);
+                free(ig->pats);
+                free(ig->dir);
+                free(ig);
+        }
+}
+
+/* gitignore rules: the last matching pattern wins, deeper files later */
+static int
+ignored(const Ignore *ig, const char *path, int isdir)
+{
+        const Ignpat *ip;
+        const char *base;
+        ulong i = 0;
+        int r;
+
+        if (ig == NULL)
+                return 0;
+        r = ignored(ig->up, path, isdir);
+        base = strrchr(path, '/');
+        base = base != NULL ? base + 1 : path;
+        for (; i < ig->n; i++) {
+                ip = &ig->pats[i];
+                if (ip->dironly && !isdir)
+                        continue;
+                if (fnmatch(ip->pat, ip->anchored ? path + strlen(ig->dir) :
+                    base, ip->anchored ? FNM_PATHNAME : 0) == 0)
+                        r = !ip->neg;
+        }
+
+        return r;
+}
+
+/*
+ * The longest run of plain characters every match must contain. Anything
+ * that could make a character optional, or an alternation, gives up on
+ * the run. Runs inside a group don't count, the group may be optional.
+ */
+static void
+greplit(Grepjob *gj)
+{
+        static const char rank[] = " etaoinsrhldcumfpgwybvkxjqz";
+        const char *p = gj->pat, *run = NULL, *best = NULL;
+        size_t len = 0, nbest = 0, i;
+        int r, rmax = -1, depth = 0;
+
+        gj->pure = strpbrk(p, ".[]()*+?{}|^$\\") == NULL;
+        gj->nlit = 0;
+        if (strchr(p, '|') != NULL)
+                return;
+        for (;; p++) {
+                if (*p != '\0' && strchr(".[]()*+?{}^$\\", *p) == NULL) {
+                        if (run == NULL)
+                                run = p;
+                        len++;
+                        continue;
+                }
+                /* "ab*" only guarantees "a" */
+                if (run != NULL && (*p == '*' || *p == '?' || *p == '{'))
+                        len--;
+                if (depth == 0 && len > nbest) {
+                        best = run;
+                        nbest = len;
+                }
+                run = NULL;
+                len = 0;
+                if (*p == '\0')
+                        break;
+                if (*p == '(')
+                        depth++;
+                else if (*p == ')' && depth > 0)
+                        depth--;
+                /* skip bracket expressions, intervals and escapes whole */
+                if (*p == '[' && (p = strchr(p + 1 + (p[1] == ']'), ']')) == NULL)
+                        break;
+                if (*p == '{' && (p = strchr(p, '}')) == NULL)
+                        break;
+                if (*p == '\\' && p[1] != '\0')
+                        p++;
+        }
+        if (nbest == 0)
+                return;
+        memcpy(gj->lit, best, nbest);
+        gj->nlit = nbest;
+        /* memchr(3) the byte least likely to show up in text */
+        for (i = 0; i < nbest; i++) {
+                r = strchr(rank, gj->lit[i]) != NULL ?
+                    (int)(strchr(rank, gj->lit[i]) - rank) : 100;
+                if (r > rmax) {
+                        rmax = r;
+                        gj->rare = i;
+                }
+        }
+}
+
+/* next occurrence of the literal, SIMD memchr(3) does the heavy lifting */
+static const uchar *
+grepfind(const Grepjob *gj, const uchar *p, const uchar *end)
+{
+        const uchar *q = p + gj->rare;
+        uchar c = gj->lit[gj->rare];
+
+        for (; q < end && (q = memchr(q, c, end - q)) != NULL; q++)
+                if (q - gj->rare + gj->nlit <= end &&
+                    !memcmp(q - gj->rare, gj->lit, gj->nlit))
+                        return q - gj->rare;
+
+        return NULL;
+}
+
+static ulong
+nlcount(const uchar *p, const uchar *end)
+{
+        ull w;
+        ulong n = 0;
+
+        for (; end - p >= 8; p += 8) {
+                memcpy(&w, p, sizeof(w));
+                n += __builtin_popcountll(nlmask(w));
+        }
+        for (; p < end; p++)
+                n += *p == '\n';
+
+        return n;
+}
+
+static void
+grepemit(Grepjob *gj, const char *path, ulong line, const uchar *p,
+         size_t len, const struct stat *st)
+{
+        Grepres *r;
+        size_t i = 0;
+
+        while (len > 0 && (*p == ' ' || *p == '\t')) {
+                p++;
+                len--;
+        }
+        len = MIN(len, GREPSNIP);
+        pthread_mutex_lock(&gj->lock);
+        if (gj->n == GREPMAX) {
+                gj->cancel = 1;
+                pthread_mutex_unlock(&gj->lock);
+                return;
+        }
+        if (gj->n == gj->cap) {
+                gj->cap = MAX(gj->cap * 2, 256);
+                if ((gj->res = realloc(gj->res, gj->cap * sizeof(Grepres))) ==
+                    NULL)
+                        die("realloc:");
+        }
+        r = &gj->res[gj->n++];
+        r->path = estrdup(path);
+        r->line = line;
+        r->snip = emalloc(len + 1);
+        for (; i < len; i++)
+                r->snip[i] = p[i] < ' ' || p[i] == DEL ? ' ' : p[i];
+        r->snip[len] = '\0';
+        r->st = *st;
+        pthread_mutex_unlock(&gj->lock);
+}
+
+/*
+ * Only lines around a literal hit are given to regexec(3), and line
+ * numbers are counted only up to matches, a word at a time.
+ */
+static void
+grepfile(Grepjob *gj, regex_t *re, const char *path, const struct stat *st,
+         uchar *buf)
+{
+        const uchar *end, *stop, *p, *ls, *le, *counted;
+        char *line = NULL;
+        size_t cap = 0, len, keep = 0;
+        ulong lineno = 1;
+        off_t off = 0;
+        ssize_t n;
+        int fd;
+
+        if ((fd = openat(gj->dfd, path, O_RDONLY)) < 0)
+                return;
+        /* pread(2) a buffer at a time, a mapping SIGBUSes if it shrinks */
+        for (;;) {
+                if ((n = pread(fd, buf + keep, PARBUF - keep, off)) < 0 ||
+                    (n == 0 && keep == 0))
+                        break;
+                if (off == 0 && memchr(buf, '\0', MIN(n, GREPBIN)) != NULL)
+                        break;
+                off += n;
+                end = buf + keep + n;
+                /* whole lines only, the rest waits for the next read */
+                for (stop = end; n > 0 && stop > buf && stop[-1] != '\n';)
+                        stop--;
+                if (stop == buf)
+                        stop = end;
+
+                for (p = counted = buf; p < stop &&
+                     !__atomic_load_n(&gj->cancel, __ATOMIC_RELAXED);
+                     p = le + 1) {
+                        if (gj->nlit > 0) {
+                                if ((ls = grepfind(gj, p, stop)) == NULL)
+                                        break;
+                                while (ls > p && ls[-1] != '\n')
+                                        ls--;
+                        } else {
+                                ls = p;
+                        }
+                        if ((le = memchr(ls, '\n', stop - ls)) == NULL)
+                                le = stop;
+                        len = le - ls;
+                        if (!gj->pure) {
+                                if (len + 1 > cap) {
+                                        cap = len + 1;
+                                        if ((line = realloc(line, cap)) ==
+                                            NULL)
+                                                die("realloc:");
+                                }
+                                memcpy(line, ls, len);
+                                line[len] = '\0';
+                                if (regexec(re, line, 0, NULL, 0) != 0)
+                                        continue;
+                        }
+                        lineno += nlcount(counted, ls);
+                        counted = ls;
+                        grepemit(gj, path, lineno, ls, len, st);
+                }
+                if (n == 0 || __atomic_load_n(&gj->cancel, __ATOMIC_RELAXED))
+                        break;
+                lineno += nlcount(counted, stop);
+                keep = end - stop;
+                memmove(buf, stop, keep);
+        }
+        free(line);
+        close(fd);
+        __atomic_fetch_add(&gj->nfiles, 1, __ATOMIC_RELAXED);
+}
+
+static void
+greppush(Grepjob *gj, char *dir, Ignore *ig)
+{
+        pthread_mutex_lock(&gj->lock);
+        if (gj->nq == gj->capq) {
+                gj->capq = MAX(gj->capq * 2, 64);
+                if ((gj->queue = realloc(gj->queue, gj->capq *
+                    sizeof(Grepdir))) == NULL)
+                        die("realloc:");
+        }
+        gj->queue[gj->nq].dir = dir;
+        gj->queue[gj->nq++].ig = ig;
+        pthread_cond_signal(&gj->cond);
+        pthread_mutex_unlock(&gj->lock);
+}
+
+static void
+grepdir(Grepjob *gj, regex_t *re, Grepdir *gd, uchar *buf)
+{
+        DIR *dp;
+        struct dirent *de;
+        struct stat st;
+        Ignore *ig;
+        char path[PATH_MAX], *sub;
+        int isdir, fd;
+
+        /* relative to dfd, the cwd may change under a running search */
+        if ((fd = openat(gj->dfd, *gd->dir ? gd->dir : ".",
+            O_RDONLY | O_DIRECTORY)) < 0)
+                return;
+        if ((dp = fdopendir(fd)) == NULL) {
+                close(fd);
+                return;
+        }
+        ig = ignload(gd->ig, gj->dfd, gd->dir);
+        while ((de = readdir(dp)) != NULL &&
+               !__atomic_load_n(&gj->cancel, __ATOMIC_RELAXED)) {
+                if (de->d_name[0] == '.' && (!gj->showall ||
+                    !strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+                    !strcmp(de->d_name, ".git")))
+                        continue;
+                if (snprintf(path, sizeof(path), "%s%s", gd->dir,
+                    de->d_name) >= sizeof(path) ||
+                    fstatat(gj->dfd, path, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                        continue;
+                if (!(isdir = S_ISDIR(st.st_mode)) && !S_ISREG(st.st_mode))
+                        continue;
+                if (ignored(ig, path, isdir))
+                        continue;
+                if (isdir) {
+                        sub = emalloc(strlen(path) + 2);
+                        sprintf(sub, "%s/", path);
+                        if (ig != NULL)
+                                __atomic_add_fetch(&ig->refs, 1,
+                                                   __ATOMIC_RELAXED);
+                        greppush(gj, sub, ig);
+                } else if (st.st_size > 0) {
+                        grepfile(gj, re, path, &st, buf);
+                }
+        }
+        closedir(dp);
+        ignput(ig);
+}
+
+static void *
+grepworker(void *arg)
+{
+        Grepjob *gj = arg;
+        Grepdir gd;
+        regex_t re;
+        uchar *buf;
+
+        PERF_THREAD("grep");
+        buf = emalloc(PARBUF);
+        /* glibc serializes regexec(3) calls on one regex_t */
+        if (regcomp(&re, gj->pat, REG_EXTENDED | REG_NOSUB) != 0)
+                die("regcomp:");
+        pthread_mutex_lock(&gj->lock);
+        for (;;) {
+                while (gj->nq == 0 && !gj->done && !gj->cancel) {
+                        if (++gj->idle == gj->nth) {
+                                gj->done = 1;
+                                pthread_cond_broadcast(&gj->cond);
+                        } else {
+                                pthread_cond_wait(&gj->cond, &gj->lock);
+                        }
+                        gj->idle--;
+                }
+                if (gj->done || gj->cancel)
+                        break;
+                gd = gj->queue[--gj->nq];
+                pthread_mutex_unlock(&gj->lock);
+                grepdir(gj, &re, &gd, buf);
+                free(gd.dir);
+                ignput(gd.ig);
+                pthread_mutex_lock(&gj->lock);
+        }
+        /* a cancelled search stops early, the queue still has to go */
+        gj->done = 1;
+        pthread_cond_broadcast(&gj->cond);
+        pthread_mutex_unlock(&gj->lock);
+        regfree(&re);
+        free(buf);
+        grepput(gj);
+
+        return NULL;
+}
+
+static void
+grepput(Grepjob *gj)
+{
+        ulong i = 0;
+
+        if (__atomic_sub_fetch(&gj->refs, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+        for (; i < gj->nq; i++) {
+                free(gj->queue[i].dir);
+                ignput(gj->queue[i].ig);
+        }
+        for (i = 0; i < gj->n; i++) {
+                free(gj->res[i].path);
+                free(gj->res[i].snip);
+        }
+        free(gj->queue);
+        free(gj->res);
+        close(gj->dfd);
+        pthread_mutex_destroy(&gj->lock);
+        pthread_cond_destroy(&gj->cond);
+        free(gj);
+}
+
+/* by file, then line; aux holds the line number */
+static int
+grepcmp(const void *x, const void *y)
+{
+        const Entry *a = x, *b = y;
+        ulong la, lb;
+        int c;
+
+        if ((c = strcmp(a->name, b->name)) != 0)
+                return c;
+        la = strtoul(a->aux, NULL, 10);
+        lb = strtoul(b->aux, NULL, 10);
+        return (la > lb) - (la < lb);
+}
+
+/* like cmpcancel() */
+static void
+grepcancel(void)
+{
+        if (curgrep == NULL)
+                return;
+        pthread_mutex_lock(&curgrep->lock);
+        curgrep->cancel = 1;
+        pthread_cond_broadcast(&curgrep->cond);
+        pthread_mutex_unlock(&curgrep->lock);
+        grepput(curgrep);
+        curgrep = NULL;
+}
+
+/* move new matches into the listing, called before every redraw */
+static void
+grepsync(void)
+{
+        Grepres *r;
+        char *name = NULL;
+        ulong i, line = 0;
+        uchar done;
+
+        if (curgrep == NULL)
+                return;
+        if (win->mode != M_GREP) {
+                grepcancel();
+                return;
+        }
+
+        pthread_mutex_lock(&curgrep->lock);
+        if (curgrep->n > win->nents) {
+                if ((win->ents = realloc(win->ents, curgrep->n *
+                    sizeof(Entry))) == NULL)
+                        die("realloc:");
+                for (i = win->nents; i < curgrep->n; i++) {
+                        r = &curgrep->res[i];
+                        entfill(&win->ents[i], r->path, DT_REG, &r->st);
+                        win->ents[i].aux = emalloc(24);
+                        snprintf(win->ents[i].aux, 24, "%6lu", r->line);
+                        win->ents[i].note = r->snip;
+                        r->snip = NULL;
+                }
+                win->nents = curgrep->n;
+        }
+        done = curgrep->done;
+        snprintf(winlabel, sizeof(winlabel), ": %.64s, %lu files%s%s",
+                 curgrep->pat, curgrep->nfiles, done ? "" : "...",
+                 curgrep->n == GREPMAX ? ", truncated" : "");
+        pthread_mutex_unlock(&curgrep->lock);
+        if (!done)
+                return;
+
+        if (win->nents > 0) {
+                name = estrdup(win->ents[win->sel].name);
+                line = strtoul(win->ents[win->sel].aux, NULL, 10);
+        }
+        qsort(win->ents, win->nents, sizeof(Entry), grepcmp);
+        for (i = 0; name != NULL && i < win->nents; i++)
+                if (!strcmp(win->ents[i].name, name) &&
+                    strtoul(win->ents[i].aux, NULL, 10) == line)
+                        win->sel = i;
+        free(name);
+        grepput(curgrep);
+        curgrep = NULL;
+}
+
+/* search file contents under the current directory */
+static void
+grepstart(const Arg *arg)
+{
+        Grepjob *gj;
+        Fsjob *job;
+        regex_t re;
+        pthread_t th;
+        char *str;
+        long ncpu;
+        int i = 0;
+
+        if (curgrep != NULL) {
+                notify(MSG_BUSY, NULL);
+                return;
+        }
+        if ((str = promptstr(msgs[MSG_GREP])) == NULL)
+                return;
+        if (*str == '\0' || strlen(str) >= BUFSIZ ||
+            regcomp(&re, str, REG_EXTENDED | REG_NOSUB) != 0) {
+                free(str);
+                notify(MSG_REGEX, NULL);
+                xdelay(DELAY_MS);
+                return;
+        }
+        regfree(&re);
+        if ((job = fsrun(fsopen, ".", curdev)) == NULL || job->err != 0) {
+                if (job != NULL)
+                        fsjobput(job);
+                free(str);
+                notify(MSG_FAIL, NULL);
+                xdelay(DELAY_MS);
+                return;
+        }
+        if ((gj = calloc(1, sizeof(Grepjob))) == NULL)
+                die("calloc:");
+        gj->dfd = job->fd;
+        job->fd = -1;
+        fsjobput(job);
+        strcpy(gj->pat, str);
+        free(str);
+        greplit(gj);
+        gj->showall = f_showall;
+
+        pthread_mutex_init(&gj->lock, NULL);
+        pthread_cond_init(&gj->cond, NULL);
+        greppush(gj, estrdup(""), NULL);
+        if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+                ncpu = 1;
+        gj->nth = MIN(ncpu, PARMAX);
+        gj->refs = gj->nth + 1;
+        pthread_mutex_lock(&gj->lock);
+        for (; i < gj->nth; i++) {
+                if (pthread_create(&th, NULL, grepworker, gj) != 0)
+                        die("pthread_create:");
+                pthread_detach(th);
+        }
+        pthread_mutex_unlock(&gj->lock);
+
+        entcleanup();
+        win->nents = 0;
+        win->sel = 0;
+        win->mode = M_GREP;
+        curgrep = gj;
+        grepsync();
+}
+
+static void
+grepedit(const Entry *ent)
+{
+        char *editor = getenv(envs[ENV_EDITOR]), line[24];
+        char *argv[] = {editor != NULL ? editor : "vi", line,
+                        (char *)ent->name, NULL};
+
+        snprintf(line, sizeof(line), "+%lu", strtoul(ent->aux, NULL, 10));
+        spawnv(argv);
+}
+
+/* numeric header field, octal or GNU base-256 */
+static ull
+tarnum(const char *p, size_t n)
+{
+        ull v = 0;
+        size_t i = 0;
+
+        if (n > 0 && (uchar)p[0] & 0x80) {
+                v = (uchar)p[0] & 0x3f;
+                for (i = 1; i < n; i++)
+                        v = v << 8 | (uchar)p[i];
+                return v;
+        }
+        for (; i < n && (p[i] == ' ' || p[i] == '\0'); i++)
+                ;
+        for (; i < n && p[i] >= '0' && p[i] <= '7'; i++)
+                v = v << 3 | (p[i] - '0');
+
+        return v;
+}
+
+/*
+ * One pass over the headers, data is skipped with the offsets and never
+ * read, except for GNU long names and pax records that rename, resize or
+ * link the next member. Hard links take their target's data.
+ */
+static int
+tarbuild(Tarindex *ti)
+{
+        Tarmember *m;
+        uchar hdr[TARBLOCK];
+        char *longname = NULL, *linkname = NULL, *data, *p, *end, *key;
+        off_t off = 0, next, size, paxsize = -1;
+        ulong cap = 0, sum, chk, j;
+        int i, ret = 0;
+
+        PERF_BEGIN(P_TARINDEX);
+        ti->n = 0;
+        ti->m = NULL;
+        for (;; off = next) {
+                if (pread(ti->fd, hdr, TARBLOCK, off) != TARBLOCK)
+                        break;
+                PERF_SYS(1);
+                if (hdr[0] == '\0')
+                        break;
+                for (sum = i = 0; i < TARBLOCK; i++)
+                        sum += (i >= 148 && i < 156) ? ' ' : hdr[i];
+                chk = tarnum((char *)hdr + 148, 8);
+                if (sum != chk) {
+                        ret = ti->n > 0 ? 0 : -1;
+                        goto out;
+                }
+                size = tarnum((char *)hdr + 124, 12);
+                next = off + TARBLOCK + ((size + TARBLOCK - 1) & ~(off_t)511);
+
+                switch (hdr[156]) {
+                case 'L': /* GNU long name of the next member */
+                case 'K': /* GNU long link name */
+                case 'x': /* pax extended header */
+                        /* anything bigger is a broken or hostile archive */
+                        if (size > (hdr[156] == 'x' ? TARMETA : PATH_MAX)) {
+                                ret = ti->n > 0 ? 0 : -1;
+                                goto out;
+                        }
+                        data = emalloc(size + 1);
+                        if (pread(ti->fd, data, size, off + TARBLOCK) != size) {
+                                free(data);
+                                goto out;
+                        }
+                        data[size] = '\0';
+                        if (hdr[156] == 'L') {
+                                free(longname);
+                                longname = data;
+                                continue;
+                        }
+                        if (hdr[156] == 'K') {
+                                free(linkname);
+                                linkname = data;
+                                continue;
+                        }
+                        /* records are "len key=value\n" */
+                        for (p = data, end = data + size; p < end;) {
+                                long len = strtol(p, &key, 10);
+
+                                if (len <= 0 || p + len > end)
+                                        break;
+                                p[len - 1] = '\0';
+                                key++;
+                                if (!strncmp(key, "path=", 5)) {
+                                        free(longname);
+                                        longname = estrdup(key + 5);
+                                } else if (!strncmp(key, "linkpath=", 9)) {
+                                        free(linkname);
+                                        linkname = estrdup(key + 9);
+                                } else if (!strncmp(key, "size=", 5)) {
+                                        paxsize = strtoll(key + 5, NULL, 10);
+                                }
+                                p += len;
+                        }
+                        free(data);
+                        continue;
+                case 'g': /* pax global header */
+                        continue;
+                }
+                /* past 8GB the size is only in the pax header */
+                if (paxsize >= 0) {
+                        size = paxsize;
+                        next = off + TARBLOCK +
+                               ((size + TARBLOCK - 1) & ~(off_t)511);
+                        paxsize = -1;
+                }
+
+                if (ti->n == cap) {
+                        cap = MAX(cap * 2, 256);
+                        if ((ti->m = realloc(ti->m,
+                            cap * sizeof(Tarmember))) == NULL)
+                                die("realloc:");
+                }
+                m = &ti->m[ti->n++];
+                if (longname != NULL) {
+                        m->path = longname;
+                        longname = NULL;
+                } else if (!memcmp(hdr + 257, "ustar", 5) && hdr[345]) {
+                        m->path = emalloc(256 + 1 + 100 + 1);
+                        sprintf(m->path, "%.155s/%.100s", hdr + 345, hdr);
+                } else {
+                        m->path = emalloc(100 + 1);
+                        sprintf(m->path, "%.100s", hdr);
+                }
+                m->off = off + TARBLOCK;
+                m->size = size;
+                m->mtime = tarnum((char *)hdr + 136, 12);
+                m->mode = tarnum((char *)hdr + 100, 8) & 07777;
+                switch (hdr[156]) {
+                case '1': /* hard link to an earlier member */
+                        if (linkname == NULL) {
+                                linkname = emalloc(100 + 1);
+                                sprintf(linkname, "%.100s", hdr + 157);
+                        }
+                        for (p = linkname; !strncmp(p, "./", 2);)
+                                p += 2;
+                        for (j = ti->n - 1; j > 0 &&
+                             strcmp(ti->m[j - 1].path, p) != 0; j--)
+                                ;
+                        m->mode |= S_IFREG;
+                        if (j > 0 && S_ISREG(ti->m[j - 1].mode)) {
+                                m->off = ti->m[j - 1].off;
+                                m->size = ti->m[j - 1].size;
+                        } else {
+                                /* nothing to extract, see tarcopy() */
+                                m->off = -1;
+                                m->size = 0;
+                        }
+                        break;
+                case '2':
+                        m->mode |= S_IFLNK;
+                        m->size = 0;
+                        break;
+                case '3':
+                        m->mode |= S_IFCHR;
+                        break;
+                case '4':
+                        m->mode |= S_IFBLK;
+                        break;
+                case '5':
+                        m->mode |= S_IFDIR;
+                        break;
+                case '6':
+                        m->mode |= S_IFIFO;
+                        break;
+                default:
+                        m->mode |= S_IFREG;
+                        break;
+                }
+                free(linkname);
+                linkname = NULL;
+                /* "./a/b/" -> "a/b" */
+                for (p = m->path; !strncmp(p, "./", 2);)
+                        p += 2;
+                memmove(m->path, p, strlen(p) + 1);
+                for (p = m->path + strlen(m->path); p > m->path && p[-1] == '/';)
+                        *--p = '\0';
+        }
+out:
+        free(longname);
+        free(linkname);
+        PERF_END(P_TARINDEX);
+
+        return ret;
+}
+
+/* cached index of the archive ent, built on first use */
+static Tarindex *
+tarindex(const Entry *ent)
+{
+        Tarindex *ti, *lru = &tarcache[0];
+        Fsjob *job;
+        ulong i = 0;
+
+        for (; i < TARCACHE; i++) {
+                ti = &tarcache[i];
+                if (ti->used && ti->dev == ent->stat.st_dev &&
+                    ti->ino == ent->stat.st_ino &&
+                    ti->mtime == ent->stat.st_mtime) {
+                        ti->used = ++tarclock;
+                        return ti;
+                }
+                if (ti->used < lru->used)
+                        lru = ti;
+        }
+
+        ti = lru;
+        if (ti->used) {
+                tarfree(ti);
+                ti->used = 0;
+        }
+        if ((job = fsrun(fstar, ent->name, ent->stat.st_dev)) == NULL)
+                return NULL;
+        if (job->err != 0) {
+                fsjobput(job);
+                return NULL;
+        }
+        ti->fd = job->tar->fd;
+        ti->m = job->tar->m;
+        ti->n = job->tar->n;
+        job->tar->fd = -1;
+        job->tar->m = NULL;
+        job->tar->n = 0;
+        fsjobput(job);
+        ti->dev = ent->stat.st_dev;
+        ti->ino = ent->stat.st_ino;
+        ti->mtime = ent->stat.st_mtime;
+        snprintf(ti->name, sizeof(ti->name), "%s", ent->name);
+        ti->used = ++tarclock;
+
+        return ti;
+}
+
+static void
+tarfree(Tarindex *ti)
+{
+        ulong i = 0;
+
+        for (; i < ti->n; i++)
+                free(ti->m[i].path);
+        free(ti->m);
+        if (ti->fd >= 0)
+                close(ti->fd);
+}
+
+static int
+tarchildcmp(const void *x, const void *y)
+{
+        const Tarchild *a = x, *b = y;
+        int c;
+
+        if ((c = strcmp(a->name, b->name)) != 0)
+                return c;
+        /* explicit members win over implied directories */
+        return (b->m >= 0) - (a->m >= 0);
+}
+
+/* list the members right under tarprefix, like a directory */
+static void
+tarlist(void)
+{
+        Tarchild *kids;
+        Tarmember *m;
+        Entry *ents;
+        struct stat st;
+        const char *rest;
+        char *slash;
+        size_t plen = strlen(tarprefix);
+        ulong i = 0, n = 0, nents = 0;
+
+        kids = emalloc(MAX(curtar->n, 1) * sizeof(Tarchild));
+        for (; i < curtar->n; i++) {
+                m = &curtar->m[i];
+                if (strncmp(m->path, tarprefix, plen) != 0)
+                        continue;
+                rest = m->path + plen;
+                if (*rest == '\0' || (!f_showall && *rest == '.'))
+                        continue;
+                if ((slash = strchr(rest, '/')) != NULL) {
+                        /* a deeper member implies the directory above it */
+                        kids[n].name = estrdup(rest);
+                        ((char *)kids[n].name)[slash - rest] = '\0';
+                        kids[n++].m = -1;
+                } else {
+                        kids[n].name = estrdup(rest);
+                        kids[n++].m = i;
+                }
+        }
+        qsort(kids, n, sizeof(Tarchild), tarchildcmp);
+
+        ents = emalloc(MAX(n, 1) * sizeof(Entry));
+        for (i = 0; i < n; i++) {
+                if (nents > 0 && !strcmp(ents[nents - 1].name, kids[i].name))
+                        continue;
+                memset(&st, 0, sizeof(st));
+                if (kids[i].m >= 0) {
+                        m = &curtar->m[kids[i].m];
+                        st.st_mode = m->mode;
+                        st.st_size = m->size;
+                        st.st_mtime = st.st_ctime = m->mtime;
+                        /* dev 0 never collides with real files */
+                        st.st_ino = kids[i].m + 1;
+                } else {
+                        st.st_mode = S_IFDIR | 0755;
+                }
+                entfill(&ents[nents], kids[i].name,
+                        S_ISDIR(st.st_mode) ? DT_DIR : DT_REG, &st);
+                ents[nents++].flags |= ENT_MEMBER;
+        }
+        for (i = 0; i < n; i++)
+                free((char *)kids[i].name);
+        free(kids);
+
+        entcleanup();
+        win->ents = ents;
+        win->nents = nents;
+        win->sel = 0;
+        win->mode = M_TAR;
+        snprintf(winlabel, sizeof(winlabel), ": %s/%s", curtar->name,
+                 tarprefix);
+        ENTSORT(win->ents, win->nents);
+}
+
+static void
+taropen(const Entry *ent)
+{
+        Tarindex *ti;
+
+        if ((ti = tarindex(ent)) == NULL) {
+                notify(MSG_TARBAD, NULL);
+                xdelay(DELAY_MS << 1);
+                return;
+        }
+        curtar = ti;
+        tarprefix[0] = '\0';
+        tarlist();
+}
+
+/* copy a member's data to fd straight from its offset in the archive */
+static int
+tarcopy(const Entry *ent, int fd)
+{
+        Tarmember *m = &curtar->m[ent->stat.st_ino - 1];
+        char buf[BUFSIZ * 8];
+        off_t off = m->off, end = m->off + m->size;
+        ssize_t n;
+
+        /* a hard link whose target isn't in the archive */
+        if (m->off < 0)
+                return -1;
+        while (off < end) {
+                if ((n = pread(curtar->fd, buf, MIN(sizeof(buf), end - off),
+                    off)) <= 0)
+                        return -1;
+                if (write(fd, buf, n) != n)
+                        return -1;
+                off += n;
+        }
+
+        return 0;
+}
+
+/* extract ent to a scratch directory, for viewers that need a path */
+static int
+tarmember(const Entry *ent, char *path, size_t len)
+{
+        const char *tmp;
+        int fd, ret;
+
+        if (curtar == NULL || ent->stat.st_ino == 0 ||
+            !S_ISREG(ent->stat.st_mode))
+                return -1;
+        if (tmpdir[0] == '\0') {
+                if ((tmp = getenv("TMPDIR")) == NULL)
+                        tmp = "/tmp";
+                snprintf(tmpdir, sizeof(tmpdir), "%s/sfm.XXXXXX", tmp);
+                if (mkdtemp(tmpdir) == NULL) {
+                        tmpdir[0] = '\0';
+                        return -1;
+                }
+        }
+        if (snprintf(path, len, "%s/%lu-%s", tmpdir, (ulong)ent->stat.st_ino,
+                     ent->name) >= len)
+                return -1;
+        if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+                return -1;
+        ret = tarcopy(ent, fd);
+        close(fd);
+
+        return ret;
+}
+
+/* extract the member under the cursor into the current directory */
+static void
+tarextract(const Arg *arg)
+{
+        Entry *ent = &win->ents[win->sel];
+        int fd, fail;
+
+        if (win->mode != M_TAR || win->nents == 0 ||
+            !S_ISREG(ent->stat.st_mode) || ent->stat.st_ino == 0)
+                return;
+        if ((fd = open(ent->name, O_WRONLY | O_CREAT | O_EXCL,
+            ent->stat.st_mode & 0777)) < 0) {
+                notify(MSG_FAIL, NULL);
+                xdelay(DELAY_MS << 1);
+                return;
+        }
+        fail = tarcopy(ent, fd);
+        if (close(fd) != 0 || fail) {
+                unlink(ent->name);
+                notify(MSG_FAIL, NULL);
+                xdelay(DELAY_MS << 1);
+        }
+}
+
+static int
+tmprm(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+        return remove(path) != 0 && errno != ENOENT;
+}
+
+/* mkdir -p */
+static int
+mkpath(const char *path, mode_t mode)
+{
+        char buf[PATH_MAX], *p;
+
+        snprintf(buf, sizeof(buf), "%s", path);
+        for (p = buf + 1; (p = strchr(p, '/')) != NULL; p++) {
+                *p = '\0';
+                if (mkdir(buf, mode) != 0 && errno != EEXIST)
+                        return -1;
+                *p = '/';
+        }
+        if (mkdir(buf, mode) != 0 && errno != EEXIST)
+                return -1;
+
+        return 0;
+}
+
+static void
+trashhome(char *buf, size_t len)
+{
+        const char *p;
+
+        if ((p = getenv("XDG_DATA_HOME")) != NULL && *p != '\0')
+                snprintf(buf, len, "%s/Trash", p);
+        else
+                snprintf(buf, len, "%s/.local/share/Trash",
+                         (p = getenv("HOME")) != NULL ? p : "");
+}
+
+/* the highest directory above path that is still on dev */
+static void
+trashtop(const char *path, dev_t dev, char *top)
+{
+        struct stat st;
+        char buf[PATH_MAX], *p;
+
+        snprintf(buf, sizeof(buf), "%s", path);
+        strcpy(top, buf);
+        while ((p = strrchr(buf, '/')) != NULL) {
+                if (p == buf)
+                        p[1] = '\0';
+                else
+                        *p = '\0';
+                if (stat(buf, &st) != 0 || st.st_dev != dev)
+                        break;
+                strcpy(top, buf);
+                if (p == buf)
+                        break;
+        }
+}
+
+/*
+ * The trash for files on dev: the home trash if it lives there, so moving
+ * in is a rename(2), otherwise $topdir/.Trash-$uid on the same volume.
+ * Finding and making it is left to a worker, only the result is cached.
+ */
+static Trash *
+trashfor(const char *path, dev_t dev)
+{
+        Trash *t;
+        Fsjob *job;
+        int i = 0;
+
+        for (; i < ntrash; i++)
+                if (trashes[i].dev == dev)
+                        return &trashes[i];
+        if ((job = fsrun(fstrash, path, dev)) == NULL)
+                return NULL;
+        t = NULL;
+        if (job->err == 0) {
+                t = &trashes[ntrash < TRASHDIRS ? ntrash++ : TRASHDIRS - 1];
+                *t = *job->trash;
+        }
+        fsjobput(job);
+
+        return t;
+}
+
+/* percent-encode everything but unreserved characters and '/' */
+static void
+urlenc(FILE *fp, const char *s)
+{
+        for (; *s != '\0'; s++) {
+                if ((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') ||
+                    (*s >= '0' && *s <= '9') || strchr("/-._~", *s) != NULL)
+                        fputc(*s, fp);
+                else
+                        fprintf(fp, "%%%02X", (uchar)*s);
+        }
+}
+
+static void
+urldec(char *s)
+{
+        char *d = s;
+        uint c;
+
+        for (; *s != '\0'; s++) {
+                if (*s == '%' && sscanf(s + 1, "%2x", &c) == 1) {
+                        *d++ = c;
+                        s += 2;
+                } else {
+                        *d++ = *s;
+                }
+        }
+        *d = '\0';
+}
+
+/*
+ * Claim a name in info/ with O_EXCL, so two trashers never pick the same
+ * one, then rename(2) the file in under it. Whole trees move in constant
+ * time and nothing is ever copied across devices.
+ */
+static int
+trashput(const char *path)
+{
+        Trash *t;
+        struct stat st;
+        time_t now = time(NULL);
+        const char *base = strrchr(path, '/') + 1, *rel = path;
+        char info[PATH_MAX], dst[PATH_MAX], date[24];
+        FILE *fp;
+        size_t len;
+        int fd, n = 1;
+
+        if (lstat(path, &st) != 0 || (t = trashfor(path, st.st_dev)) == NULL)
+                return -1;
+        for (;; n++) {
+                if (n == 1)
+                        len = snprintf(info, sizeof(info),
+                                       "%s/info/%s.trashinfo", t->path, base);
+                else
+                        len = snprintf(info, sizeof(info),
+                                       "%s/info/%s.%d.trashinfo", t->path,
+                                       base, n);
+                if (len >= sizeof(info)) {
+                        errno = ENAMETOOLONG;
+                        return -1;
+                }
+                if ((fd = open(info, O_WRONLY | O_CREAT | O_EXCL, 0600)) >= 0)
+                        break;
+                if (errno != EEXIST)
+                        return -1;
+        }
+        if (n == 1)
+                len = snprintf(dst, sizeof(dst), "%s/files/%s", t->path,
+                               base);
+        else
+                len = snprintf(dst, sizeof(dst), "%s/files/%s.%d", t->path,
+                               base, n);
+        if (len >= sizeof(dst))
+                goto fail;
+
+        /* trashes under a top directory store paths relative to it */
+        if (t->top[0] != '\0')
+                rel = path + strlen(t->top) + (strcmp(t->top, "/") != 0);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+        if ((fp = fdopen(fd, "w")) == NULL) {
+                close(fd);
+                goto fail;
+        }
+        fputs("[Trash Info]\nPath=", fp);
+        urlenc(fp, rel);
+        fprintf(fp, "\nDeletionDate=%s\n", date);
+        if (fclose(fp) != 0 || renamenx(AT_FDCWD, path, dst) != 0)
+                goto fail;
+
+        return 0;
+fail:
+        unlink(info);
+        return -1;
+}
+
+/* where the trashed file at path came from, and its .trashinfo */
+static int
+trashorig(const char *path, char *orig, char *info)
+{
+        FILE *fp;
+        const char *p;
+        char buf[PATH_MAX + 16], top[PATH_MAX];
+        size_t n;
+        int found = 0;
+
+        /* $trash/files/name, a /files/ further up is somebody's dir */
+        if ((p = strrchr(path, '/')) == NULL || p - path < 6 ||
+            strncmp(p - 6, "/files", 6) != 0)
+                return -1;
+        p -= 6;
+        n = p - path;
+        snprintf(info, PATH_MAX, "%.*s/info/%s.trashinfo", (int)n, path,
+                 p + 7);
+        if ((fp = fopen(info, "r")) == NULL)
+                return -1;
+        while (!found && fgets(buf, sizeof(buf), fp) != NULL) {
+                if (strncmp(buf, "Path=", 5) != 0)
+                        continue;
+                buf[strcspn(buf, "\n")] = '\0';
+                urldec(buf + 5);
+                found = 1;
+        }
+        fclose(fp);
+        if (!found)
+                return -1;
+        if (buf[5] == '/')
+                return snprintf(orig, PATH_MAX, "%s", buf + 5) < PATH_MAX ?
+                       0 : -1;
+        /* relative to the volume the trash is on */
+        snprintf(top, sizeof(top), "%.*s", (int)n, path);
+        if ((p = strrchr(top, '/')) == NULL)
+                return -1;
+        return snprintf(orig, PATH_MAX, "%.*s/%s", (int)(p - top), top,
+                        buf + 5) < PATH_MAX ? 0 : -1;
+}
+
+/* trashes worth looking at: home, the ones used so far and the cwd's */
+static int
+trashdirs(char (*dirs)[PATH_MAX])
+{
+        struct stat st;
+        char top[PATH_MAX];
+        int i = 0, j, n = 0;
+
+        trashhome(dirs[n++], PATH_MAX);
+        for (; i < ntrash; i++)
+                if (trashes[i].dev != (dev_t)-1)
+                        snprintf(dirs[n++], PATH_MAX, "%s", trashes[i].path);
+        if (stat(curdir, &st) == 0) {
+                trashtop(curdir, st.st_dev, top);
+                if (snprintf(dirs[n], PATH_MAX, "%s/.Trash-%u",
+                    strcmp(top, "/") ? top : "", (uint)getuid()) < PATH_MAX)
+                        n++;
+        }
+        /* drop duplicates and trashes that don't exist */
+        for (i = 0; i < n; i++) {
+                for (j = 0; j < i; j++)
+                        if (!strcmp(dirs[i], dirs[j]))
+                                break;
+                if (j < i || lstat(dirs[i], &st) != 0 ||
+                    !S_ISDIR(st.st_mode))
+                        memmove(dirs[i], dirs[--n], PATH_MAX), i--;
+        }
+
+        return n;
+}
+
+static void
+trash(const Arg *arg)
+{
+        Entry *ent;
+        Selent *se;
+        struct stat st;
+        char *path;
+        ulong i = 0, n = 0;
+        int fail = 0;
+
+        if (win->nents == 0)
+                return;
+        if (win->mode == M_TRASH) {
+                notify(MSG_FAIL, NULL);
+                return;
+        }
+        if (selset.n == 0) {
+                ent = entat(win->sel);
+                if (ent->flags & (ENT_MISSING | ENT_MEMBER)) {
+                        notify(MSG_FAIL, NULL);
+                        return;
+                }
+                path = selpath(ent);
+                fail = trashput(path);
+                free(path);
+        }
+        for (; i < selset.cap && selset.n > 0; i++)
+                if ((se = &selset.ents[i])->path != NULL)
+                        fail |= trashput(se->path);
+        selclear();
+        if (win->mode == M_DUPS) {
+                /* nothing to reload, drop the copies that went away */
+                for (i = 0; i < win->nents; i++) {
+                        ent = &win->ents[i];
+                        if (lstat(ent->name, &st) != 0 && errno == ENOENT) {
+                                free(ent->name);
+                                free(ent->aux);
+                                free(ent->note);
+                        } else {
+                                win->ents[n++] = *ent;
+                        }
+                }
+                win->nents = n;
+        } else {
+                f_redraw = 1;
+        }
+        if (fail) {
+                notify(MSG_FAIL, NULL);
+                xdelay(DELAY_MS);
+        }
+}
+
+static void
+trashlist(const Arg *arg)
+{
+        DIR *dp;
+        struct dirent *de;
+        struct stat st;
+        Entry *ents = NULL;
+        char dirs[TRASHDIRS + 2][PATH_MAX], path[PATH_MAX], orig[PATH_MAX];
+        char info[PATH_MAX];
+        ulong n = 0, cap = 0;
+        size_t len;
+        int i = 0, ndirs = trashdirs(dirs);
+
+        for (; i < ndirs; i++) {
+                if (snprintf(path, sizeof(path), "%s/info", dirs[i]) >=
+                    sizeof(path) || (dp = opendir(path)) == NULL)
+                        continue;
+                while ((de = readdir(dp)) != NULL) {
+                        len = strlen(de->d_name);
+                        if (len <= 10 ||
+                            strcmp(de->d_name + len - 10, ".trashinfo"))
+                                continue;
+                        if (snprintf(path, sizeof(path), "%s/files/%.*s",
+                            dirs[i], (int)(len - 10), de->d_name) >=
+                            sizeof(path) || lstat(path, &st) != 0 ||
+                            trashorig(path, orig, info) != 0)
+                                continue;
+                        if (n == cap) {
+                                cap = cap ? cap << 1 : 64;
+                                if ((ents = realloc(ents, cap *
+                                    sizeof(Entry))) == NULL)
+                                        die("realloc:");
+                        }
+                        entfill(&ents[n], path,
+                                S_ISDIR(st.st_mode) ? DT_DIR : DT_REG, &st);
+                        ents[n++].aux = estrdup(orig);
+                }
+                closedir(dp);
+        }
+
+        entcleanup();
+        win->ents = ents;
+        win->nents = n;
+        win->sel = 0;
+        win->mode = M_TRASH;
+        winlabel[0] = '\0';
+        ENTSORT(win->ents, win->nents);
+}
+
+/* put a trashed file back where it came from, never over another file */
+static int
+untrash(const char *path)
+{
+        char orig[PATH_MAX], info[PATH_MAX];
+
+        if (trashorig(path, orig, info) != 0 ||
+            renamenx(AT_FDCWD, path, orig) != 0)
+                return -1;
+        unlink(info);
+
+        return 0;
+}
+
+static void
+restore(const Arg *arg)
+{
+        Selent *se;
+        ulong i = 0;
+        long sel;
+        int fail = 0;
+
+        if (win->mode != M_TRASH || win->nents == 0) {
+                notify(MSG_FAIL, NULL);
+                return;
+        }
+        if (selset.n == 0)
+                fail = untrash(win->ents[win->sel].name);
+        for (; i < selset.cap && selset.n > 0; i++)
+                if ((se = &selset.ents[i])->path != NULL)
+                        fail |= untrash(se->path);
+        selclear();
+        sel = win->sel;
+        trashlist(NULL);
+        win->sel = sel;
+        if (fail) {
+                notify(MSG_FAIL, NULL);
+                xdelay(DELAY_MS);
+        }
+}
+
+static int
+purgerm(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+        Purge *pg = purgecur;
+        long ahead;
+
+        remove(path);
+        /* stay under purgerate so the disk is left to everyone else */
+        if (++pg->nrm % PURGEBATCH == 0 &&
+            (ahead = pg->nrm * 1000 / purgerate - (msclock() - pg->t0)) > 0)
+                usleep(ahead * 1000);
+
+        return 0;
+}
+
+static void *
+purge(void *arg)
+{
+        Purge *pg = arg;
+        int i = 0;
+
+        pg->nrm = 0;
+        pg->t0 = msclock();
+        purgecur = pg;
+        for (; i < pg->n; i++)
+                nftw(pg->dirs[i], purgerm, 32, FTW_DEPTH | FTW_PHYS);
+        purgecur = NULL;
+        free(pg->dirs);
+        free(pg);
+        __atomic_store_n(&f_purgebusy, 0, __ATOMIC_RELEASE);
+
+        return NULL;
+}
+
+/*
+ * Renaming files/ and info/ out of the way empties a trash at once; the
+ * actual unlinking happens on a thread at a bounded rate.
+ */
+static void
+trashempty(const Arg *arg)
+{
+        Purge *pg;
+        pthread_t th;
+        char dirs[TRASHDIRS + 2][PATH_MAX], src[PATH_MAX], dst[PATH_MAX];
+        const char *sub[] = {"files", "info"};
+        int i = 0, j, ndirs;
+
+        if (__atomic_load_n(&f_purgebusy, __ATOMIC_ACQUIRE)) {
+                notify(MSG_BUSY, NULL);
+                return;
+        }
+        f_noconfirm = 0;
+        if (!confirmact("empty trash"))
+                return;
+        ndirs = trashdirs(dirs);
+        pg = emalloc(sizeof(Purge));
+        pg->dirs = emalloc(MAX(ndirs, 1) * sizeof(*pg->dirs));
+        pg->n = 0;
+        for (; i < ndirs; i++) {
+                if (snprintf(pg->dirs[pg->n], PATH_MAX, "%s/expunged",
+                    dirs[i]) >= PATH_MAX || (mkdir(pg->dirs[pg->n], 0700) != 0
+                    && errno != EEXIST))
+                        continue;
+                for (j = 0; j < 2; j++) {
+                        if (snprintf(src, sizeof(src), "%s/%s", dirs[i],
+                            sub[j]) >= sizeof(src) ||
+                            snprintf(dst, sizeof(dst), "%s/%s.%ld.%d",
+                            pg->dirs[pg->n], sub[j], (long)time(NULL),
+                            (int)getpid()) >= sizeof(dst))
+                                continue;
+                        if (rename(src, dst) == 0)
+                                mkdir(src, 0700);
+                }
+                pg->n++;
+        }
+
+        f_purgebusy = 1;
+        if (pthread_create(&th, NULL, purge, pg) != 0)
+                die("pthread_create:");
+        pthread_detach(th);
+        if (win->mode == M_TRASH)
+                trashlist(NULL);
+}
+
+/* bytes equal to '\n' get their top bit set, the others are zero */
+static inline ull
+nlmask(ull w)
+{
+        ull x = w ^ 0x0a0a0a0a0a0a0a0aULL;
+
+        return ~(((x & 0x7f7f7f7f7f7f7f7fULL) + 0x7f7f7f7f7f7f7f7fULL) | x |
+                 0x7f7f7f7f7f7f7f7fULL);
+}
+
+/* record the start of line nidx * VIEWSTEP, readers see it after nidx */
+static void
+viewadd(View *v, off_t off)
+{
+        ulong k = v->nidx;
+
+        if (k / VIEWBLK >= v->nblk) {
+                /* only once the indexer is done, see viewremap() */
+                v->nblk = k / VIEWBLK + 16;
+                if ((v->blk = realloc(v->blk, v->nblk * sizeof(off_t *))) ==
+                    NULL)
+                        die("realloc:");
+                memset(v->blk + k / VIEWBLK, 0,
+                       (v->nblk - k / VIEWBLK) * sizeof(off_t *));
+        }
+        if (v->blk[k / VIEWBLK] == NULL)
+                v->blk[k / VIEWBLK] = emalloc(VIEWBLK * sizeof(off_t));
+        v->blk[k / VIEWBLK][k % VIEWBLK] = off;
+        __atomic_store_n(&v->nidx, k + 1, __ATOMIC_RELEASE);
+}
+
+static off_t
+viewidx(View *v, ulong k)
+{
+        return v->blk[k / VIEWBLK][k % VIEWBLK];
+}
+
+/*
+ * Count newlines a word at a time and only look at single bytes in the
+ * rare words where an index entry is due.
+ */
+static void
+viewscan(View *v, const uchar *map, off_t from, off_t to)
+{
+        const uchar *p = map + from, *end = map + to;
+        ull w, m, nl = v->nl, next = (ull)v->nidx * VIEWSTEP;
+        int i, c;
+
+        for (; end - p >= 8; p += 8) {
+                memcpy(&w, p, sizeof(w));
+                if ((m = nlmask(w)) == 0)
+                        continue;
+                c = __builtin_popcountll(m);
+                if (nl + c < next) {
+                        nl += c;
+                        continue;
+                }
+                for (i = 0; i < 8; i++) {
+                        if (p[i] == '\n' && ++nl == next) {
+                                viewadd(v, p + i + 1 - map);
+                                next += VIEWSTEP;
+                        }
+                }
+        }
+        for (; p < end; p++) {
+                if (*p == '\n' && ++nl == next) {
+                        viewadd(v, p + 1 - map);
+                        next += VIEWSTEP;
+                }
+        }
+        v->nl = nl;
+        __atomic_store_n(&v->idxend, to, __ATOMIC_RELEASE);
+}
+
+static void *
+viewindex(void *arg)
+{
+        View *v = arg;
+        off_t off = 0, to;
+
+        PERF_THREAD("viewindex");
+        PERF_BEGIN(P_VIEWINDEX);
+        while (off < v->isize && !__atomic_load_n(&v->cancel,
+                                                   __ATOMIC_RELAXED)) {
+                to = MIN(off + VIEWCHUNK, v->isize);
+                viewscan(v, v->imap, off, to);
+                /* done with these pages, don't let them pile up in RSS */
+                madvise((void *)(v->imap + (off & ~(off_t)4095)),
+                        to - (off & ~(off_t)4095), MADV_DONTNEED);
+                off = to;
+        }
+        PERF_END(P_VIEWINDEX);
+        __atomic_store_n(&v->indexing, 0, __ATOMIC_RELEASE);
+
+        return NULL;
+}
+
+static int
+viewopen(View *v, const char *path)
+{
+        Fsjob *job;
+
+        memset(v, 0, sizeof(*v));
+        v->name = path;
+        /* a dead mount can hang open(2) and mmap(2) both */
+        if ((job = fsrun(fsmap, path, curdev)) == NULL)
+                return -1;
+        if (job->err != 0 || !S_ISREG(job->st.st_mode)) {
+                fsjobput(job);
+                return -1;
+        }
+        v->fd = job->fd;
+        v->size = v->isize = job->st.st_size;
+        v->map = job->map;
+        v->imap = job->imap;
+        job->fd = -1;
+        job->map = job->imap = NULL;
+        fsjobput(job);
+
+        /* enough index blocks for one byte lines, the indexer can't grow */
+        v->nblk = v->isize / VIEWSTEP / VIEWBLK + 1;
+        if ((v->blk = calloc(v->nblk, sizeof(off_t *))) == NULL)
+                die("calloc:");
+        viewadd(v, 0);
+
+        if (v->imap != NULL && v->imap != MAP_FAILED) {
+                madvise((void *)v->imap, v->isize, MADV_SEQUENTIAL);
+                v->indexing = 1;
+                if (pthread_create(&v->th, NULL, viewindex, v) != 0)
+                        v->indexing = 0;
+        }
+
+        return 0;
+}
+
+static void
+viewclose(View *v)
+{
+        ulong i = 0;
+
+        if (v->imap != NULL && v->imap != MAP_FAILED) {
+                __atomic_store_n(&v->cancel, 1, __ATOMIC_RELAXED);
+                pthread_join(v->th, NULL);
+                munmap((void *)v->imap, v->isize);
+        }
+        if (v->map != NULL)
+                munmap((void *)v->map, v->size);
+        for (; i < v->nblk; i++)
+                free(v->blk[i]);
+        free(v->blk);
+        close(v->fd);
+}
+
+static off_t
+viewnext(View *v, off_t off)
+{
+        const uchar *p;
+
+        if (v->hex)
+                return off + 16 < v->size ? off + 16 : off;
+        if ((p = memchr(v->map + off, '\n', v->size - off)) == NULL ||
+            p + 1 - v->map >= v->size)
+                return off;
+        return p + 1 - v->map;
+}
+
+static off_t
+viewprev(View *v, off_t off)
+{
+        if (v->hex)
+                return off >= 16 ? off - 16 : 0;
+        if (off == 0)
+                return 0;
+        for (off--; off > 0 && v->map[off - 1] != '\n'; off--)
+                ;
+        return off;
+}
+
+/* top offset that puts the end of the file on the last row */
+static off_t
+viewend(View *v)
+{
+        off_t off = v->size;
+        int r = 0;
+
+        if (v->size == 0)
+                return 0;
+        if (v->hex) {
+                off = ((v->size - 1) / 16) * 16;
+                for (; r < YMAX - 2 && off > 0; r++)
+                        off -= 16;
+                return off;
+        }
+        if (v->map[off - 1] != '\n') {
+                for (; off > 0 && v->map[off - 1] != '\n'; off--)
+                        ;
+                r++;
+        } else {
+                off = viewprev(v, off);
+                r++;
+        }
+        for (; r < YMAX - 1 && off > 0; r++)
+                off = viewprev(v, off);
+
+        return off;
+}
+
+/* start of line n (0-based), -1 if the index hasn't got there yet */
+static off_t
+viewline(View *v, ull n)
+{
+        ulong k = n / VIEWSTEP, nidx;
+        off_t off, next;
+        ull i = 0;
+
+        nidx = __atomic_load_n(&v->nidx, __ATOMIC_ACQUIRE);
+        if (k >= nidx) {
+                if (__atomic_load_n(&v->indexing, __ATOMIC_ACQUIRE))
+                        return -1;
+                return viewend(v);
+        }
+        off = viewidx(v, k);
+        for (; i < n % VIEWSTEP; i++, off = next)
+                if ((next = viewnext(v, off)) == off)
+                        break;
+
+        return off;
+}
+
+/* 1-based line number at off, 0 if not indexed that far yet */
+static long
+viewlineno(View *v, off_t off)
+{
+        ulong lo = 0, hi, mid;
+        const uchar *p, *end = v->map + off;
+        long n;
+
+        if (off >= __atomic_load_n(&v->idxend, __ATOMIC_ACQUIRE))
+                return 0;
+        hi = __atomic_load_n(&v->nidx, __ATOMIC_ACQUIRE) - 1;
+        while (lo < hi) {
+                mid = lo + (hi - lo + 1) / 2;
+                if (viewidx(v, mid) <= off)
+                        lo = mid;
+                else
+                        hi = mid - 1;
+        }
+        n = lo * VIEWSTEP + 1;
+        for (p = v->map + viewidx(v, lo);
+             (p = memchr(p, '\n', end - p)) != NULL; p++)
+                n++;
+
+        return n;
+}
+
+/* draw one line, clipped to the screen, with tabs and controls expanded */
+static void
+viewrow(const uchar *p, size_t len)
+{
+        const uchar *run;
+        int col = 0, max = XMAX;
+
+        while (len > 0 && col < max) {
+                if (*p == '\t') {
+                        do
+                                addch(' ');
+                        while (++col % VIEWTAB != 0 && col < max);
+                } else if (*p < ' ' || *p == DEL) {
+                        addch('.');
+                        col++;
+                } else {
+                        /* printable run, UTF-8 continuation bytes are free */
+                        for (run = p; len > 0 && col < max && *p >= ' ' &&
+                             *p != DEL; p++, len--)
+                                if ((*p & 0xc0) != 0x80)
+                                        col++;
+                        addnstr((const char *)run, p - run);
+                        continue;
+                }
+                p++;
+                len--;
+        }
+}
+
+static void
+viewdraw(View *v)
+{
+        const uchar *eol;
+        off_t off = v->top;
+        long line;
+        int row = 0, i;
+
+        erase();
+        for (; row < YMAX - 1 && off < v->size; row++) {
+                move(row, 0);
+                if (v->hex) {
+                        printw("%08llx  ", (ull)off);
+                        for (i = 0; i < 16; i++)
+                                if (off + i < v->size)
+                                        printw("%02x%s", v->map[off + i],
+                                               i == 7 ? "  " : " ");
+                                else
+                                        printw("   %s", i == 7 ? " " : "");
+                        addch(' ');
+                        for (i = 0; i < 16 && off + i < v->size; i++)
+                                addch(v->map[off + i] >= ' ' &&
+                                      v->map[off + i] < DEL ?
+                                      v->map[off + i] : '.');
+                        off += 16;
+                        continue;
+                }
+                eol = memchr(v->map + off, '\n', v->size - off);
+                i = eol != NULL ? eol - (v->map + off) : v->size - off;
+                viewrow(v->map + off, i);
+                off += i + 1;
+        }
+
+        attron(A_REVERSE);
+        mvprintw(YMAX - 1, 0, "%s  %llu/%llu %d%%", v->name, (ull)v->top,
+                 (ull)v->size, v->size ? (int)(v->top * 100 / v->size) : 100);
+        if (!v->hex && (line = viewlineno(v, v->top)) > 0)
+                printw("  line %ld", line);
+        if (__atomic_load_n(&v->indexing, __ATOMIC_ACQUIRE))
+                printw("  [indexing %d%%]", (int)(__atomic_load_n(&v->idxend,
+                       __ATOMIC_ACQUIRE) * 100 / MAX(v->isize, 1)));
+        if (v->hex)
+                addstr("  [hex]");
+        if (v->follow)
+                addstr("  [follow]");
+        attroff(A_REVERSE);
+}
+
+/*
+ * Remap a file that changed size and index the new part, for follow mode.
+ * Pages past the end of a truncated file SIGBUS, so a shrink stops the
+ * indexer and starts the index over.
+ */
+static void
+viewremap(View *v)
+{
+        struct stat st;
+        const uchar *map = NULL;
+
+        if (fstat(v->fd, &st) != 0 || st.st_size == v->size)
+                return;
+        if (st.st_size < v->size) {
+                if (v->imap != NULL && v->imap != MAP_FAILED) {
+                        __atomic_store_n(&v->cancel, 1, __ATOMIC_RELAXED);
+                        pthread_join(v->th, NULL);
+                        munmap((void *)v->imap, v->isize);
+                }
+                v->imap = NULL;
+                v->isize = 0;
+                __atomic_store_n(&v->indexing, 0, __ATOMIC_RELEASE);
+                v->nidx = v->idxend = v->nl = 0;
+                viewadd(v, 0);
+        }
+        if (st.st_size > 0 && (map = mmap(NULL, st.st_size, PROT_READ,
+            MAP_PRIVATE, v->fd, 0)) == MAP_FAILED) {
+                /* keep what's shown if it only grew */
+                if (st.st_size > v->size)
+                        return;
+                map = NULL;
+                st.st_size = 0;
+        }
+        if (v->map != NULL)
+                munmap((void *)v->map, v->size);
+        v->map = map;
+        v->size = st.st_size;
+        /* the indexer owns the index until it's done */
+        if (!__atomic_load_n(&v->indexing, __ATOMIC_ACQUIRE) &&
+            v->idxend >= v->isize && v->idxend < v->size)
+                viewscan(v, v->map, v->idxend, v->size);
+        v->top = viewend(v);
+}
+
+static void
+view(const Arg *arg)
+{
+        View v;
+        Entry *ent;
+        char path[PATH_MAX], *str;
+        const char *name;
+        off_t off;
+        int ch, i, running = 1;
+
+        if (win->nents == 0)
+                return;
+        ent = entat(win->sel);
+        name = ent->name;
+        if (!S_ISREG(ent->stat.st_mode))
+                return;
+        if (ent->flags & ENT_MEMBER) {
+                if (tarmember(ent, path, sizeof(path)) != 0)
+                        return;
+                name = path;
+        }
+        if (viewopen(&v, name) != 0) {
+                notify(MSG_FAIL, NULL);
+                return;
+        }
+
+        while (running) {
+                /* before drawing, the file may have been truncated */
+                if (v.follow)
+                        viewremap(&v);
+                viewdraw(&v);
+                timeout(v.follow ? VIEWFOLLOW_MS : v.indexing ? 500 : -1);
+                switch ((ch = getch())) {
+                case 'q':
+                case 'h':
+                case KEY_LEFT:
+                        running = 0;
+                        break;
+                case 'j':
+                case '\n':
+                case KEY_DOWN:
+                        v.top = viewnext(&v, v.top);
+                        break;
+                case 'k':
+                case KEY_UP:
+                        v.top = viewprev(&v, v.top);
+                        break;
+                case ' ':
+                case CTRL('f'):
+                case KEY_NPAGE:
+                        for (i = 0; i < YMAX - 2; i++)
+                                v.top = viewnext(&v, v.top);
+                        break;
+                case 'b':
+                case CTRL('b'):
+                case KEY_PPAGE:
+                        for (i = 0; i < YMAX - 2; i++)
+                                v.top = viewprev(&v, v.top);
+                        break;
+                case 'g':
+                case KEY_HOME:
+                        v.top = 0;
+                        break;
+                case 'G':
+                case KEY_END:
+                        v.top = viewend(&v);
+                        break;
+                case 'x':
+                        v.hex ^= 1;
+                        v.top = v.hex ? v.top & ~(off_t)15 :
+                                viewprev(&v, viewnext(&v, v.top));
+                        break;
+                case 'F':
+                        v.follow ^= 1;
+                        break;
+                case ':':
+                        timeout(-1);
+                        if ((str = promptstr(msgs[MSG_VIEWLINE])) == NULL)
+                                break;
+                        if ((off = viewline(&v, MAX(atol(str), 1) - 1)) < 0) {
+                                notify(MSG_VIEWIDX, NULL);
+                                xdelay(DELAY_MS);
+                        } else {
+                                v.hex = 0;
+                                v.top = off;
+                        }
+                        free(str);
+                        break;
+                case '%':
+                        timeout(-1);
+                        if ((str = promptstr(msgs[MSG_VIEWPCT])) == NULL)
+                                break;
+                        off = v.size * MIN(MAX(atol(str), 0), 100) / 100;
+                        if (off >= v.size)
+                                v.top = viewend(&v);
+                        else if (v.hex)
+                                v.top = off & ~(off_t)15;
+                        else
+                                for (v.top = off; v.top > 0 &&
+                                     v.map[v.top - 1] != '\n'; v.top--)
+                                        ;
+                        free(str);
+                        break;
+                }
+        }
+
+        viewclose(&v);
+        timeout(-1);
+}
+
+static void
+sort(const Arg *arg)
+{
+        /* duplicate groups have their own order */
+        if (win->mode == M_DUPS || win->mode == M_GREP ||
+            (win->mode == M_CMP && curcmp != NULL))
+                return;
+        notify(MSG_SORT, NULL);
+
+        switch (getch()) {
+        case 'n':
+                f_namesort = 1;
+                f_sizesort = f_datesort = 0;
+                break;
+        case 's':
+                f_sizesort = 1;
+                f_namesort = f_datesort = 0;
+                break;
+        case 'd':
+                f_datesort = 1;
+                f_namesort = f_sizesort = 0;
+        case 'r':
+                f_revsort ^= 1;
+                break;
+        }
+
+        if (!f_revsort) {
+                if (f_namesort)
+                        sortfn = namecmp;
+                else if (f_sizesort)
+                        sortfn = sizecmp;
+                else if (f_datesort)
+                        sortfn = datecmp;
+        } else {
+                if (f_namesort)
+                        sortfn = revnamecmp;
+                else if (f_sizesort)
+                        sortfn = revsizecmp;
+                else if (f_datesort)
+                        sortfn = revdatecmp;
+        }
+
+        if (win->big != NULL)
+                bigsort(win->big);
+        else
+                ENTSORT(win->ents, win->nents);
+}
+
+static void
+prompt(const Arg *arg)
+{
+        char buf[BUFSIZ];
+
+        sprintf(buf, "%s", promptstr(msgs[MSG_PROMPT]));
+        if (confirmact(buf)) {
+                spawn(buf);
+                f_redraw = 1;
+        }
+}
+
+/*
+ * The scroll offset follows from the selection alone, so any jump, however
+ * many keys it took, lands in the right place.
+ */
+static void
+selcorrect(void)
+{
+        int rows = YMAX - 3, off;
+
+        if (win->sel > (long)win->nents - 1)
+                win->sel = win->nents - 1;
+        if (win->sel < 0)
+                win->sel = 0;
+
+        off = MIN(SCROLLOFF, MAX(rows - 1, 0) / 2);
+        if (win->sel - curscroll > rows - 1 - off)
+                curscroll = win->sel - (rows - 1 - off);
+        else if (win->sel - curscroll < off)
+                curscroll = win->sel - off;
+        curscroll = MAX(MIN(curscroll, (int)win->nents - rows), 0);
+        cur = win->sel - curscroll;
+}
+
+static long
+msclock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+/* lines a key moves the cursor by, 0 for anything else */
+static int
+keymotion(int ch)
+{
+        int i = 0;
+
+        for (; i < ARRLEN(keys); i++) {
+                if (ch != keys[i].key || keys[i].func != nav)
+                        continue;
+                if (keys[i].arg.n == NAV_UP)
+                        return -1;
+                if (keys[i].arg.n == NAV_DOWN)
+                        return 1;
+        }
+
+        return 0;
+}
+
+static void
+keyrun(int ch)
+{
+        int i = 0;
+
+        PERF_BEGIN(P_KEY);
+        PERF_ARG(P_KEY, ch);
+        for (; i < ARRLEN(keys); i++)
+                if (ch == keys[i].key)
+                        keys[i].func(&(keys[i].arg));
+        PERF_END(P_KEY);
+}
+
+/*
+ * Take everything that's queued before drawing again. Cursor motion is
+ * summed into one move, so key repeat over a slow link can't build a
+ * backlog of frames. Other keys may change the listing and end the frame
+ * right away. Keys arriving within frame_ms of the last redraw are waited
+ * for, which caps the redraw rate.
+ */
+static void
+input(void)
+{
+        int ch, d, moved = 0;
+        long wait;
+
+#ifdef PERF
+        /* everything up to the next draw() is one frame, however many keys */
+        perfreset();
+#endif /* PERF */
+        /* wake up for new results while a comparison runs */
+        timeout(curcmp != NULL || curgrep != NULL ? 100 : -1);
+        ch = getch();
+        while (ch != ERR) {
+                if ((d = keymotion(ch)) == 0) {
+                        win->sel += moved;
+                        moved = 0;
+                        keyrun(ch);
+                        break;
+                }
+                moved += d;
+                wait = frame_ms - (msclock() - lastdraw);
+                timeout(MAX(wait, 0));
+                ch = getch();
+        }
+        win->sel += moved;
+        timeout(-1);
+}
+
+static void
+entcleanup(void)
+{
+        int i = 0;
+
+        if (win->big != NULL) {
+                bigfree(win->big);
+                win->big = NULL;
+        }
+        if (win->ents != NULL) {
+                for (; i < win->nents; i++)
+                        if (win->ents[i].name != NULL) {
+                                free(win->ents[i].name);
+                                free(win->ents[i].aux);
+                                free(win->ents[i].note);
+                        }
+                free(win->ents);
+                win->ents = NULL;
+        }
+}
+
+static void
+tabsave(void)
+{
+        Tab *t = &tabs[curtab];
+
+        t->curscroll = curscroll;
+        t->dev = curdev;
+        t->sortfn = sortfn;
+        t->namesort = f_namesort;
+        t->sizesort = f_sizesort;
+        t->datesort = f_datesort;
+        t->revsort = f_revsort;
+        t->showall = f_showall;
+        memcpy(t->label, winlabel, sizeof(winlabel));
+}
+
+/*
+ * Put tab i on screen. Its listing is kept unless the directory changed
+ * in a way the watch didn't report, which the mtime gives away.
+ */
+static void
+tabload(int i)
+{
+        Tab *t = &tabs[i];
+        struct stat st;
+        dev_t dev;
+        char *p;
+
+        curtab = i;
+        win = &t->win;
+        curdir = t->dir;
+        curscroll = t->curscroll;
+        curdev = t->dev;
+        sortfn = t->sortfn;
+        f_namesort = t->namesort;
+        f_sizesort = t->sizesort;
+        f_datesort = t->datesort;
+        f_revsort = t->revsort;
+        f_showall = t->showall;
+        memcpy(winlabel, t->label, sizeof(winlabel));
+
+        tabsync();
+        /* the directory may be gone, fall back to what's left of it */
+        for (dev = t->dev; echdir(t->dir, dev, &st) != 0;
+             dev = (dev_t)-1) {
+                if ((p = strrchr(t->dir, '/')) == NULL ||
+                    (p == t->dir && p[1] == '\0')) {
+                        tabclose(NULL);
+                        return;
+                }
+                p[p == t->dir] = '\0';
+                win->mode = M_DIR;
+                t->stale = 1;
+        }
+        if (st.st_mtim.tv_sec != t->mtime.tv_sec ||
+            st.st_mtim.tv_nsec != t->mtime.tv_nsec)
+                t->stale = 1;
+        if (t->stale && win->mode == M_DIR)
+                f_redraw = 1;
+}
+
+/* searches feed the listing on screen, and archives aren't kept per tab */
+static void
+tableave(void)
+{
+        cmpcancel();
+        grepcancel();
+        if (win->mode == M_TAR) {
+                win->mode = M_DIR;
+                tabs[curtab].stale = 1;
+        }
+        tabsave();
+}
+
+static void
+tabwatch(Tab *t)
+{
+        int wd = -1;
+
+#ifdef __linux__
+        if (infd >= 0 && !mntdegraded(mntget(curdev)))
+                wd = inotify_add_watch(infd, t->dir, IN_CREATE | IN_DELETE |
+                                       IN_MOVED_FROM | IN_MOVED_TO |
+                                       IN_ATTRIB | IN_CLOSE_WRITE |
+                                       IN_DELETE_SELF | IN_MOVE_SELF |
+                                       IN_ONLYDIR);
+#endif /* __linux__ */
+        if (wd != t->wd)
+                tabunwatch(t);
+        t->wd = wd;
+}
+
+/* tabs showing the same directory share a watch */
+static void
+tabunwatch(Tab *t)
+{
+        int i = 0;
+
+        if (t->wd < 0)
+                return;
+        for (; i < ntabs; i++)
+                if (&tabs[i] != t && tabs[i].wd == t->wd)
+                        break;
+#ifdef __linux__
+        if (i == ntabs)
+                inotify_rm_watch(infd, t->wd);
+#endif /* __linux__ */
+        t->wd = -1;
+}
+
+static long
+tabfind(const Win *w, const char *name)
+{
+        ulong i = 0;
+
+        for (; i < w->nents; i++)
+                if (!strcmp(w->ents[i].name, name))
+                        return i;
+
+        return -1;
+}
+
+/* the cursor stays on the entry it was on */
+static void
+tabremove(Tab *t, ulong i)
+{
+        Win *w = &t->win;
+
+        free(w->ents[i].name);
+        free(w->ents[i].aux);
+        free(w->ents[i].note);
+        memmove(&w->ents[i], &w->ents[i + 1],
+                (w->nents - i - 1) * sizeof(Entry));
+        w->nents--;
+        if (w->sel > (long)i)
+                w->sel--;
+}
+
+static long
+tabinsert(Tab *t, const char *name)
+{
+        Win *w = &t->win;
+        Entry ent;
+        Fsjob *job;
+        char path[PATH_MAX];
+        ulong lo = 0, hi = w->nents, mid;
+
+        if (snprintf(path, sizeof(path), "%s/%s", t->dir, name) >=
+            sizeof(path))
+                return -1;
+        /* a mount that stopped answering gets a rescan instead */
+        if (mntdegraded(mntget(t->dev)) ||
+            (job = fsrun(fsstat, path, t->dev)) == NULL) {
+                t->stale = 1;
+                return -1;
+        }
+        if (job->err != 0) {
+                fsjobput(job);
+                return -1;
+        }
+        entfill(&ent, name, job->dtype, &job->st);
+        fsjobput(job);
+        while (lo < hi) {
+                mid = lo + (hi - lo) / 2;
+                if (t->sortfn(&w->ents[mid], &ent) <= 0)
+                        lo = mid + 1;
+                else
+                        hi = mid;
+        }
+        if ((w->ents = realloc(w->ents, (w->nents + 1) * sizeof(Entry))) ==
+            NULL)
+                die("realloc:");
+        memmove(&w->ents[lo + 1], &w->ents[lo],
+                (w->nents - lo) * sizeof(Entry));
+        w->ents[lo] = ent;
+        if (w->nents++ > 0 && w->sel >= (long)lo)
+                w->sel++;
+
+        return lo;
+}
+
+/* one inotify(7) event, a name that was added, removed or changed */
+static void
+tabapply(Tab *t, uint mask, const char *name)
+{
+        long i;
+        int cursor;
+
+        /* virtual listings go back to the directory with a rescan anyway */
+        if (t->win.mode != M_DIR || t->win.big != NULL) {
+                t->stale = 1;
+                return;
+        }
+        if (!t->showall && name[0] == '.')
+                return;
+        if ((i = tabfind(&t->win, name)) >= 0) {
+                cursor = i == t->win.sel;
+                tabremove(t, i);
+        } else {
+                cursor = 0;
+        }
+#ifdef __linux__
+        if (mask & (IN_DELETE | IN_MOVED_FROM))
+                return;
+#endif /* __linux__ */
+        if ((i = tabinsert(t, name)) >= 0 && cursor)
+                t->win.sel = i;
+}
+
+/*
+ * Apply what the watches saw since the last frame, to every tab. Tabs that
+ * fell too far behind are left for a rescan when they're shown.
+ */
+static void
+tabsync(void)
+{
+#ifdef __linux__
+        union {
+                struct inotify_event ev;
+                char buf[TABBUF];
+        } u;
+        const struct inotify_event *ev;
+        Fsjob *job;
+        Tab *t;
+        ssize_t n;
+        char *p;
+        int i, nev[TABS] = {0};
+
+        if (infd < 0)
+                return;
+        tabsave();
+        while ((n = read(infd, u.buf, sizeof(u.buf))) > 0) {
+                for (p = u.buf; p < u.buf + n; p += sizeof(*ev) + ev->len) {
+                        ev = (const struct inotify_event *)p;
+                        for (i = 0; i < ntabs; i++) {
+                                t = &tabs[i];
+                                if (ev->mask & IN_Q_OVERFLOW) {
+                                        t->stale = 1;
+                                        continue;
+                                }
+                                if (ev->wd != t->wd)
+                                        continue;
+                                if (ev->mask & IN_IGNORED)
+                                        t->wd = -1;
+                                if (ev->mask & (IN_IGNORED | IN_DELETE_SELF |
+                                    IN_MOVE_SELF) || ++nev[i] > TABBURST)
+                                        t->stale = 1;
+                                else if (!t->stale && ev->len > 0)
+                                        tabapply(t, ev->mask, ev->name);
+                        }
+                }
+        }
+        for (i = 0; i < ntabs; i++) {
+                t = &tabs[i];
+                if (nev[i] == 0 || t->stale)
+                        continue;
+                if (mntdegraded(mntget(t->dev)) ||
+                    (job = fsrun(fsstat, t->dir, t->dev)) == NULL) {
+                        t->stale = 1;
+                        continue;
+                }
+                if (job->err == 0)
+                        t->mtime = job->st.st_mtim;
+                fsjobput(job);
+        }
+        /* a spilled listing isn't rescanned behind the user's back */
+        if (tabs[curtab].stale && win->mode == M_DIR && win->big == NULL)
+                f_redraw = 1;
+#endif /* __linux__ */
+}
+
+static void
+tabprint(void)
+{
+        char buf[NAME_MAX + 16];
+        const char *name;
+        int i = 0;
+
+        if (ntabs < 2)
+                return;
+        move(1, 0);
+        for (; i < ntabs; i++) {
+                name = strrchr(tabs[i].dir, '/');
+                name = name == NULL || name[1] == '\0' ? tabs[i].dir :
+                       name + 1;
+                snprintf(buf, sizeof(buf), " %d:%s ", i + 1, name);
+                if (i == curtab)
+                        attron(A_REVERSE);
+                addnstr(buf, MAX(XMAX - getcurx(stdscr), 0));
+                if (i == curtab)
+                        attroff(A_REVERSE);
+        }
+}
+
+/* a new tab on the current directory, with the same sort and filter */
+static void
+tabnew(const Arg *arg)
+{
+        Tab *t = &tabs[ntabs];
+
+        if (ntabs == TABS) {
+                notify(MSG_FAIL, NULL);
+                return;
+        }
+        tableave();
+        *t = tabs[curtab];
+        t->win.ents = NULL;
+        t->win.big = NULL;
+        t->win.sel = t->win.nents = 0;
+        t->win.mode = M_DIR;
+        t->label[0] = '\0';
+        t->curscroll = 0;
+        t->wd = -1;
+        t->stale = 1;
+        tabload(ntabs++);
+}
+
+static void
+tabgo(const Arg *arg)
+{
+        if (arg->n >= ntabs || arg->n == curtab)
+                return;
+        tableave();
+        tabload(arg->n);
+}
+
+static void
+tabclose(const Arg *arg)
+{
+        int i = curtab;
+
+        if (ntabs == 1) {
+                notify(MSG_FAIL, NULL);
+                return;
+        }
+        cmpcancel();
+        grepcancel();
+        entcleanup();
+        tabunwatch(&tabs[i]);
+        memmove(&tabs[i], &tabs[i + 1], (ntabs - i - 1) * sizeof(Tab));
+        ntabs--;
+        tabload(MIN(i, ntabs - 1));
+}
+
+static void
+xdelay(useconds_t delay)
+{
+        refresh();
+        usleep(delay);
+}
+
+/*
+ * open(2) on a worker so a dead mount can't hang us, fchdir(2) is safe.
+ * dev is the target's device, (dev_t)-1 if it isn't known yet; the wait is
+ * that mount's to shrink, not the one being left. The directory's stat(2)
+ * goes to st, if not NULL.
+ */
+static int
+echdir(const char *path, dev_t dev, struct stat *st)
+{
+        Fsjob *job;
+        Mount *mnt = dev != (dev_t)-1 ? mntget(dev) : NULL;
+        struct timespec dl;
+        int ret = -1;
+
+        job = fsjobnew(fsopen, path);
+        fssubmit(job);
+        fsdeadline(&dl, mnt != NULL ? mnt->deadline : fsdeadline_ms);
+        if (fswait(job, FS_DONE, &dl) < FS_DONE) {
+                if (mnt != NULL)
+                        mntresult(mnt, 0);
+                notify(MSG_TIMEOUT, NULL);
+                xdelay(DELAY_MS << 2);
+        } else if (job->err != 0 || fchdir(job->fd) != 0) {
+                notify(MSG_FAIL, NULL);
+                xdelay(DELAY_MS << 2);
+        } else {
+                curdev = job->st.st_dev;
+                mntresult(mntget(curdev), 1);
+                if (st != NULL)
+                        *st = job->st;
+                ret = 0;
+        }
+        fsjobput(job);
+
+        return ret;
+}
+
+static void
+fsinit(void)
+{
+        pthread_condattr_t ca;
+
+        pthread_condattr_init(&ca);
+        pthread_condattr_setclock(&ca, CLOCK_MONOTONIC);
+        if (pthread_cond_init(&fsdone, &ca) != 0)
+                die("pthread_cond_init:");
+        pthread_condattr_destroy(&ca);
+}
+
+static void *
+fsworker(void *arg)
+{
+        Fsjob *job;
+
+        PERF_THREAD("fsworker");
+        pthread_mutex_lock(&fslock);
+        for (;;) {
+                while (fsqueue == NULL) {
+                        fsidle++;
+                        pthread_cond_wait(&fswork, &fslock);
+                        fsidle--;
+                }
+                job = fsqueue;
+                if ((fsqueue = job->next) == NULL)
+                        fsqtail = NULL;
+                pthread_mutex_unlock(&fslock);
+
+                job->fn(job);
+                fsphase(job, FS_DONE);
+                fsjobput(job);
+
+                pthread_mutex_lock(&fslock);
+        }
+
+        return NULL;
+}
+
+static Fsjob *
+fsjobnew(void (*fn)(Fsjob *), const char *path)
+{
+        Fsjob *job;
+
+        if ((job = calloc(1, sizeof(Fsjob))) == NULL)
+                die("calloc:");
+        job->fn = fn;
+        job->refs = 1;
+        job->fd = -1;
+        snprintf(job->path, sizeof(job->path), "%s", path);
+
+        return job;
+}
+
+static void
+fsjobput(Fsjob *job)
+{
+        if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL) > 0)
+                return;
+        if (job->fd >= 0)
+                close(job->fd);
+        if (job->namesfp != NULL)
+                fclose(job->namesfp);
+        if (job->recsfp != NULL)
+                fclose(job->recsfp);
+        if (job->map != NULL && job->map != MAP_FAILED)
+                munmap(job->map, job->st.st_size);
+        if (job->imap != NULL && job->imap != MAP_FAILED)
+                munmap(job->imap, job->st.st_size);
+        free(job->trash);
+        if (job->tar != NULL) {
+                tarfree(job->tar);
+                free(job->tar);
+        }
+        free(job->names);
+        free(job->dtypes);
+        free(job->sts);
+        free(job);
+}
+
+/* queue a job, growing the pool if every worker is busy or stuck */
+static void
+fssubmit(Fsjob *job)
+{
+        pthread_t th;
+
+        job->refs++;
+        pthread_mutex_lock(&fslock);
+        if (fsqtail != NULL)
+                fsqtail->next = job;
+        else
+                fsqueue = job;
+        fsqtail = job;
+        if (fsidle == 0 && fsnworkers < FSWORKERS &&
+            pthread_create(&th, NULL, fsworker, NULL) == 0) {
+                pthread_detach(th);
+                fsnworkers++;
+        }
+        pthread_cond_signal(&fswork);
+        pthread_mutex_unlock(&fslock);
+}
+
+static void
+fsphase(Fsjob *job, int phase)
+{
+        pthread_mutex_lock(&fslock);
+        job->phase = phase;
+        pthread_cond_broadcast(&fsdone);
+        pthread_mutex_unlock(&fslock);
+}
+
+/* wait for job to reach phase or the deadline, return the phase reached */
+static int
+fswait(Fsjob *job, int phase, const struct timespec *dl)
+{
+        int ret;
+
+        pthread_mutex_lock(&fslock);
+        while (job->phase < phase)
+                if (pthread_cond_timedwait(&fsdone, &fslock, dl) == ETIMEDOUT)
+                        break;
+        ret = job->phase;
+        pthread_mutex_unlock(&fslock);
+
+        return ret;
+}
+
+/* run fn on path and wait for it, NULL if dev's mount didn't answer */
+static Fsjob *
+fsrun(void (*fn)(Fsjob *), const char *path, dev_t dev)
+{
+        Fsjob *job;
+        Mount *mnt = mntget(dev);
+        struct timespec dl;
+
+        job = fsjobnew(fn, path);
+        job->st.st_dev = dev;
+        fssubmit(job);
+        fsdeadline(&dl, mnt->deadline);
+        if (fswait(job, FS_DONE, &dl) < FS_DONE) {
+                mntresult(mnt, 0);
+                fsjobput(job);
+                return NULL;
+        }
+
+        return job;
+}
+
+static void
+fsdeadline(struct timespec *ts, int ms)
+{
+        clock_gettime(CLOCK_MONOTONIC, ts);
+        ts->tv_sec += ms / 1000;
+        ts->tv_nsec += (ms % 1000) * 1000000L;
+        if (ts->tv_nsec >= 1000000000L) {
+                ts->tv_sec++;
+                ts->tv_nsec -= 1000000000L;
+        }
+}
+
+static void
+fsload(Fsjob *job)
+{
+        DIR *dir;
+        struct dirent *dent;
+        size_t len, cap = 0;
+        ulong i = 0, ncap = 0;
+        const char *name;
+
+        PERF_BEGIN(P_READDIR);
+        if ((dir = opendir(job->path)) == NULL ||
+            fstat(dirfd(dir), &job->st) != 0) {
+                job->err = errno;
+                if (dir != NULL)
+                        closedir(dir);
+                PERF_END(P_READDIR);
+                return;
+        }
+        PERF_SYS(2);
+
+        while ((dent = readdir(dir)) != NULL) {
+                if (!strcmp(dent->d_name, "..") || !strcmp(dent->d_name, "."))
+                        continue;
+                if (!job->showall && dent->d_name[0] == '.')
+                        continue;
+                __atomic_store_n(&job->seen, job->n, __ATOMIC_RELAXED);
+                len = strlen(dent->d_name) + 1;
+                /* spill on whichever limit comes first */
+                if (job->namesfp == NULL &&
+                    ((job->spill != 0 && job->n == job->spill) ||
+                     (job->spillmem != 0 && job->nameslen +
+                      job->n * sizeof(Bigrec) > job->spillmem)) &&
+                    bigspill(job) != 0) {
+                        job->err = errno != 0 ? errno : EIO;
+                        closedir(dir);
+                        PERF_END(P_READDIR);
+                        return;
+                }
+                if (job->namesfp != NULL) {
+                        bigput(job, dent->d_name, len, dent->d_type);
+                        continue;
+                }
+                if (job->nameslen + len > cap) {
+                        cap = MAX(cap * 2, job->nameslen + len + BUFSIZ);
+                        if ((job->names = realloc(job->names, cap)) == NULL)
+                                die("realloc:");
+                }
+                if (job->n == ncap) {
+                        ncap = MAX(ncap * 2, 64);
+                        if ((job->dtypes = realloc(job->dtypes, ncap)) == NULL)
+                                die("realloc:");
+                }
+                memcpy(job->names + job->nameslen, dent->d_name, len);
+                job->nameslen += len;
+                job->dtypes[job->n++] = dent->d_type;
+        }
+        if (job->namesfp == NULL)
+                job->sts = emalloc(MAX(job->n, 1) * sizeof(struct stat));
+        PERF_END(P_READDIR);
+        fsphase(job, FS_LISTED);
+
+        for (name = job->names; !job->nostat && i < job->n; i++) {
+                PERF_BEGIN(P_STAT);
+                if (fstatat(dirfd(dir), name, &job->sts[i], 0) != 0 &&
+                    fstatat(dirfd(dir), name, &job->sts[i],
+                            AT_SYMLINK_NOFOLLOW) != 0)
+                        memset(&job->sts[i], 0, sizeof(struct stat));
+                PERF_SYS(1);
+                PERF_END(P_STAT);
+                __atomic_store_n(&job->nstat, i + 1, __ATOMIC_RELEASE);
+                name += strlen(name) + 1;
+        }
+        closedir(dir);
+        PERF_SYS(1);
+}
+
+static void
+fsopen(Fsjob *job)
+{
+        if ((job->fd = open(job->path, O_RDONLY | O_DIRECTORY)) < 0 ||
+            fstat(job->fd, &job->st) != 0)
+                job->err = errno;
+        PERF_SYS(2);
+}
+
+/* stat(2) through links, the link itself if it dangles */
+static void
+fsstat(Fsjob *job)
+{
+        struct stat lst;
+
+        PERF_SYS(2);
+        if (lstat(job->path, &lst) != 0) {
+                job->err = errno;
+                return;
+        }
+        job->dtype = S_ISLNK(lst.st_mode) ? DT_LNK :
+                     S_ISDIR(lst.st_mode) ? DT_DIR : DT_REG;
+        if (stat(job->path, &job->st) != 0)
+                job->st = lst;
+}
+
+static void
+fsfile(Fsjob *job)
+{
+        if ((job->fd = open(job->path, O_RDONLY)) < 0 ||
+            fstat(job->fd, &job->st) != 0)
+                job->err = errno;
+        PERF_SYS(2);
+}
+
+/* the pager's view and its indexer's, only of regular files */
+static void
+fsmap(Fsjob *job)
+{
+        fsfile(job);
+        if (job->err != 0 || !S_ISREG(job->st.st_mode) ||
+            job->st.st_size == 0)
+                return;
+        if ((job->map = mmap(NULL, job->st.st_size, PROT_READ, MAP_PRIVATE,
+            job->fd, 0)) == MAP_FAILED) {
+                job->err = errno;
+                return;
+        }
+        job->imap = mmap(NULL, job->st.st_size, PROT_READ, MAP_PRIVATE,
+                         job->fd, 0);
+        PERF_SYS(2);
+}
+
+static void
+fstrash(Fsjob *job)
+{
+        Trash *t;
+        struct stat st;
+        char buf[PATH_MAX];
+        dev_t dev = job->st.st_dev;
+
+        t = job->trash = emalloc(sizeof(Trash));
+        t->dev = dev;
+        trashhome(t->path, sizeof(t->path));
+        t->top[0] = '\0';
+        if (mkpath(t->path, 0700) != 0 || stat(t->path, &st) != 0 ||
+            st.st_dev != dev) {
+                trashtop(job->path, dev, t->top);
+                if (snprintf(t->path, sizeof(t->path), "%s/.Trash-%u",
+                    strcmp(t->top, "/") ? t->top : "", (uint)getuid()) >=
+                    sizeof(t->path))
+                        goto fail;
+                if (mkdir(t->path, 0700) != 0 && errno != EEXIST)
+                        goto fail;
+                /* don't follow a link someone else planted there */
+                if (lstat(t->path, &st) != 0 || !S_ISDIR(st.st_mode) ||
+                    st.st_uid != getuid())
+                        goto fail;
+        }
+        if (snprintf(buf, sizeof(buf), "%s/files", t->path) >= sizeof(buf) ||
+            (mkdir(buf, 0700) != 0 && errno != EEXIST))
+                goto fail;
+        if (snprintf(buf, sizeof(buf), "%s/info", t->path) >= sizeof(buf) ||
+            (mkdir(buf, 0700) != 0 && errno != EEXIST))
+                goto fail;
+        return;
+fail:
+        job->err = errno != 0 ? errno : ENAMETOOLONG;
+}
+
+/* the archive's whole index is built here, every header is a pread(2) */
+static void
+fstar(Fsjob *job)
+{
+        fsfile(job);
+        if (job->err != 0)
+                return;
+        if ((job->tar = calloc(1, sizeof(Tarindex))) == NULL)
+                die("calloc:");
+        job->tar->fd = job->fd;
+        job->fd = -1;
+        if (tarbuild(job->tar) != 0)
+                job->err = EINVAL;
+}
+
+static void
+fssniff(Fsjob *job)
+{
+        int fd;
+
+        if ((fd = open(job->path, O_RDONLY | O_NONBLOCK)) < 0) {
+                job->err = errno;
+                job->nbuf = 0;
+                return;
+        }
+        job->nbuf = read(fd, job->buf, sizeof(job->buf));
+        close(fd);
+        PERF_SYS(3);
+}
+
+static Mount *
+mntget(dev_t dev)
+{
+        Mount *m, *lru = &mounts[0];
+        int i = 0;
+
+        for (; i < MOUNTS; i++) {
+                m = &mounts[i];
+                if (m->deadline != 0 && m->dev == dev)
+                        return m;
+                if (m->deadline == 0 || m->timeouts < lru->timeouts)
+                        lru = m;
+        }
+        lru->dev = dev;
+        lru->deadline = fsdeadline_ms;
+        lru->timeouts = 0;
+        lru->degraded = 0;
+
+        return lru;
+}
+
+/* degraded mounts skip stat(2) until it's time to probe them again */
+static int
+mntdegraded(Mount *m)
+{
+        if (m->degraded == 0)
+                return 0;
+        if (time(NULL) - m->degraded < fsretry)
+                return 1;
+        m->degraded = 0;
+        return 0;
+}
+
+/* shrink the deadline of a mount that keeps timing out, reset on success */
+static void
+mntresult(Mount *m, int ok)
+{
+        if (ok) {
+                m->timeouts = 0;
+                m->deadline = fsdeadline_ms;
+                return;
+        }
+        m->deadline = MAX(m->deadline / 2, fsdeadline_ms / 8);
+        if (++m->timeouts >= fsdegrade)
+                m->degraded = time(NULL);
+}
+
+static void *
+emalloc(size_t nb)
+{
+        void *p;
+
+        if ((p = malloc(nb)) == NULL)
+                die("emalloc:");
+        PERF_BYTES(nb);
+        return p;
+}
+
+static char *
+estrdup(const char *str)
+{
+        return strcpy(emalloc(strlen(str) + 1), str);
+}
+
+static void
+cleanup(void)
+{
+        int i = 0;
+
+        for (; i < ntabs; i++) {
+                win = &tabs[i].win;
+                entcleanup();
+        }
+        if (infd >= 0)
+                close(infd);
+        selclear();
+        free(selset.ents);
+        if (tmpdir[0] != '\0')
+                nftw(tmpdir, tmprm, 16, FTW_DEPTH | FTW_PHYS);
+        endwin();
+#ifdef PERF
+        traceclose();
+        if (f_perfdump)
+                perfdump();
+#endif /* PERF */
+}
+
+static void
+usage(void)
+{
+        die("usage: sfm [-Hi" PERFUSAGE "]");
+}
+
+static void
+die(const char *fmt, ...)
+{
+        va_list args;
+        
+        va_start(args, fmt);
+        vfprintf(stderr, fmt, args);
+        va_end(args);
+
+        if (fmt[0] && fmt[strlen(fmt)-1] == ':') {
+                fputc(' ', stderr);
+                perror(NULL);
+        } else
+                fputc('\n', stderr);
+
+        exit(EXIT_FAILURE);
+}
+
+#ifdef PERF
+static ull
+perfclock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (ull)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-static int
-confirmact(const char *str)
+static void
+perfbegin(Perfmark *m)
 {
-        if (f_noconfirm)
-                return 1;
-        notify(MSG_EXEC, str);
-        return (getch() == 'y');
+        m->sys = perfsys;
+        m->bytes = perfbytes;
+        m->arg = -1;
+        m->ns = perfclock();
 }
 
-static int
-spawn(char *cmd)
+static void
+perfend(int id, const Perfmark *m)
 {
-        char *args[] = {getenv(envs[ENV_SHELL]), "-c", cmd, NULL};
-        struct sigaction oldsighup;
-        struct sigaction oldsigtstp;
-        pid_t pid;
-        int status;
+        Perfstat *ps[2] = {&perf[id], &perffrm[id]};
+        ull now = perfclock(), ns = now - m->ns;
+        int b = ns, e, i = 0;
 
-        switch (pid = fork()) {
-        case -1:
-                return 1;
-        case 0:
-                execvp(*args, args);
-                _exit(EXIT_SUCCESS);
-                break;
-        default:
-                endwin();
-                while (wait(&status) != pid)
+        if (tracefp != NULL)
+                tracepush(id, m, now);
+
+        /* 4 linear sub-buckets per power of two, ~25% resolution */
+        if (ns >= 4) {
+                for (e = 0; (ns >> e) > 1; e++)
                         ;
-                sigaction(SIGHUP, &oldsighup, NULL);
-                sigaction(SIGTSTP, &oldsigtstp, NULL);
-                break;
+                b = (e << 2) | ((ns >> (e - 2)) & 3);
+        }
+        for (; i < ARRLEN(ps); i++) {
+                __atomic_fetch_add(&ps[i]->calls, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&ps[i]->sys, perfsys - m->sys,
+                                   __ATOMIC_RELAXED);
+                __atomic_fetch_add(&ps[i]->bytes, perfbytes - m->bytes,
+                                   __ATOMIC_RELAXED);
+                __atomic_fetch_add(&ps[i]->hist[b], 1, __ATOMIC_RELAXED);
         }
-        return 0;
 }
 
-static void
-nav(const Arg *arg)
+/* lower bound of the bucket holding the pct-th percentile */
+static ull
+perfpct(const Perfstat *ps, int pct)
 {
-        Entry *ent = &win->ents[win->sel];
-        char buf[BUFSIZ];
+        ulong n = 0, want;
+        int b = 0;
 
-        switch (arg->n) {
-        case NAV_LEFT:
-                echdir("..");
-                f_redraw = 1;
-                break;
-        case NAV_RIGHT:
-                if (ent->flags & DT_DIR)
-                        echdir(ent->name);
-
-                /* TODO: handle links to dirs */
-                if (ent->flags & DT_REG && ent->flags & ~DT_LNK) {
-                        sprintf(buf, "%s %s", cmds[CMD_OPEN],
-                                win->ents[win->sel].name);
-                        /* TODO: escape this buf! */
-                        if (!spawn(buf))
-                                notify(MSG_FAIL, NULL);
-                }
-                f_redraw = 1;
-                break;
-        case NAV_UP:
-                win->sel--;
-                /* 
-                 * Sign indicates direction, number indicates how many
-                 * new directories we should show on every scroll.
-                 */
-                scrolldir = -1;
-                break;
-        case NAV_DOWN:
-                win->sel++;
-                scrolldir = 1;
-                break;
-        case NAV_TOP:
-                win->sel = 0;
-                break;
-        case NAV_BOTTOM:
-                win->sel = win->nents - 1;
-                break;
-        case NAV_SELECT:
-                win->ents[win->sel].selected ^= 1;
-                if (win->ents[win->sel++].selected)
-                        win->nsel++;
-                else
-                        win->nsel--;
-                break;
-        case NAV_SHOWALL:
-                f_showall ^= 1;
-                f_redraw = 1;
-                break;
-        case NAV_INFO:
-                f_info ^= 1;
-                f_redraw = 1;
-                break;
-        case NAV_REDRAW:
-                f_redraw = 1;
-                break;
-        case NAV_EXIT:
-                f_running = 0;
-                break;
-        }
+        if (ps->calls == 0)
+                return 0;
+        want = (ps->calls * pct + 99) / 100;
+        for (; b < PERFBUCKETS; b++)
+                if ((n += ps->hist[b]) >= want)
+                        break;
+        if (b < 4)
+                return b;
+        return (ull)(4 | (b & 3)) << ((b >> 2) - 2);
 }
 
-static void
-cd(const Arg *arg)
+static char *
+fmtns(ull ns)
 {
-        echdir(arg->s);
-        f_redraw = 1;
+        static char buf[24];
+
+        if (ns < 1000)
+                sprintf(buf, "%lluns", ns);
+        else if (ns < 1000000)
+                sprintf(buf, "%lluus", ns / 1000);
+        else if (ns < 1000000000)
+                sprintf(buf, "%llums", ns / 1000000);
+        else
+                sprintf(buf, "%llus", ns / 1000000000);
+
+        return buf;
 }
 
-static void
-run(const Arg *arg)
+/* key names: \n, \e, ^x and <up>, <down>, <left>, <right>, <pgup>, ... */
+static int
+replaykeys(const char *s, int *keys, int max)
 {
-        char buf[BUFSIZ];
-        char tmp[BUFSIZ];
-        int i = 0;
+        static const struct { const char *name; int key; } names[] = {
+                {"<up>", KEY_UP}, {"<down>", KEY_DOWN}, {"<left>", KEY_LEFT},
+                {"<right>", KEY_RIGHT}, {"<pgup>", KEY_PPAGE},
+                {"<pgdn>", KEY_NPAGE}, {"<home>", KEY_HOME},
+                {"<end>", KEY_END}, {"<space>", ' '},
+        };
+        int n = 0, i;
 
-        sprintf(buf, "%s", (const char *)arg->v);
-
-        /*TODO: make prettier */
-        if (win->nsel > 0) {
-                for (; i < win->nents; i++) {
-                        if (win->ents[i].selected) {
-                                escape(tmp, win->ents[i].name);
-                                sprintf(buf + strlen(buf), " %s ", tmp);
-                        }
+        while (*s != '\0') {
+                if (n == max)
+                        return -1;
+                if (s[0] == '\\' && s[1] != '\0') {
+                        keys[n++] = s[1] == 'n' ? '\n' : s[1] == 'e' ? ESC :
+                                    s[1];
+                        s += 2;
+                        continue;
+                }
+                if (s[0] == '^' && s[1] != '\0') {
+                        keys[n++] = CTRL(s[1]);
+                        s += 2;
+                        continue;
+                }
+                for (i = 0; i < ARRLEN(names); i++)
+                        if (!strncmp(s, names[i].name, strlen(names[i].name)))
+                                break;
+                if (i < ARRLEN(names)) {
+                        keys[n++] = names[i].key;
+                        s += strlen(names[i].name);
+                } else {
+                        keys[n++] = (uchar)*s++;
                 }
-        } else {
-                escape(tmp, win->ents[win->sel].name);
-                sprintf(buf + strlen(buf), " %s ", tmp);
         }
 
-        f_noconfirm = 0;
-        if (confirmact(buf)) {
-                spawn(buf);
-                f_redraw = 1;
-        }
+        return n;
 }
 
+/*
+ * Fill dir with n entries: random names, one directory in 16, sparse files
+ * of random size and random mtimes, so every sort order has work to do.
+ */
 static void
-builtinrun(const Arg *arg)
+replaypopulate(const char *dir, long n)
 {
-        Arg prog;
+        struct timespec ts[2];
+        char path[PATH_MAX];
+        ull x = 0x9e3779b97f4a7c15ULL;
+        long i = 0;
+        int fd;
 
-        switch (arg->n) {
-        case RUN_EDITOR:
-                prog.s = getenv(envs[ENV_EDITOR]);
-                break;
-        case RUN_PAGER:
-                prog.s = getenv(envs[ENV_PAGER]);
-                break;
-        case RUN_OPENWITH:
-                if ((prog.s = promptstr(msgs[MSG_OPENWITH])) == NULL)
-                        return;
-                break;
-        case RUN_RENAME:
-                /* FIXME */
-                /*sprintf(prog.s, "%s %s %s", cmds[CMD_MV], tmp,*/
-                        /*promptstr(msgs[MSG_RENAME]));*/
-                return;
-                break;
-        default:
-                return;
+        if (mkdir(dir, 0755) != 0)
+                die("mkdir %s:", dir);
+        for (; i < n; i++) {
+                x ^= x << 13;
+                x ^= x >> 7;
+                x ^= x << 17;
+                if (snprintf(path, sizeof(path), "%s/%06llx%ld", dir,
+                    x & 0xffffff, i) >= sizeof(path))
+                        die("%s: path too long", dir);
+                if (i % 16 == 0) {
+                        if (mkdir(path, 0755) != 0)
+                                die("mkdir %s:", path);
+                        continue;
+                }
+                if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0)
+                        die("open %s:", path);
+                ftruncate(fd, (x >> 24) % (1 << 24));
+                ts[0].tv_sec = ts[1].tv_sec = 1000000000 + (x >> 40) % 1000000;
+                ts[0].tv_nsec = ts[1].tv_nsec = 0;
+                futimens(fd, ts);
+                close(fd);
         }
+}
 
-        f_noconfirm = 0;
-        run(&prog);
-        f_redraw = 1;
+/* the pty has no reader otherwise and ncurses would block on a full one */
+static void *
+replaydrain(void *arg)
+{
+        char buf[BUFSIZ];
+        int fd = *(int *)arg;
+
+        while (read(fd, buf, sizeof(buf)) > 0 || errno == EINTR)
+                ;
+
+        return NULL;
 }
 
+/* ncurses on a pty nobody looks at, same size every run */
 static void
-sort(const Arg *arg)
+replayterm(void)
 {
-        notify(MSG_SORT, NULL);
+        static int master;
+        struct winsize ws = {REPLAYROWS, REPLAYCOLS, 0, 0};
+        pthread_t th;
+        FILE *in, *out;
+        const char *term;
+        int slave;
 
-        switch (getch()) {
-        case 'n':
-                f_namesort = 1;
-                f_sizesort = f_datesort = 0;
-                break;
-        case 's':
-                f_sizesort = 1;
-                f_namesort = f_datesort = 0;
-                break;
-        case 'd':
-                f_datesort = 1;
-                f_namesort = f_sizesort = 0;
-        case 'r':
-                f_revsort ^= 1;
-                break;
-        }
+        if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 ||
+            grantpt(master) != 0 || unlockpt(master) != 0 ||
+            (slave = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0)
+                die("pty:");
+        ioctl(slave, TIOCSWINSZ, &ws);
+        if ((in = fdopen(slave, "r")) == NULL ||
+            (out = fdopen(dup(slave), "w")) == NULL)
+                die("fdopen:");
+        if (pthread_create(&th, NULL, replaydrain, &master) != 0)
+                die("pthread_create:");
+        pthread_detach(th);
+        if ((term = getenv("TERM")) == NULL || *term == '\0')
+                term = "xterm";
+        if (newterm(term, out, in) == NULL)
+                die("newterm %s:", term);
+}
 
-        if (!f_revsort) {
-                if (f_namesort)
-                        sortfn = namecmp;
-                else if (f_sizesort)
-                        sortfn = sizecmp;
-                else if (f_datesort)
-                        sortfn = datecmp;
-        } else {
-                if (f_namesort)
-                        sortfn = revnamecmp;
-                else if (f_sizesort)
-                        sortfn = revsizecmp;
-                else if (f_datesort)
-                        sortfn = revdatecmp;
+/*
+ * Run a key script and time every action from the first key to the end of
+ * the refresh(3) that shows its result. A script is made of lines
+ *
+ *      dir N                   make a directory of N entries, cd next to
+ *                              it and select it, so "key enter l" measures
+ *                              the load
+ *      key LABEL KEYS [COUNT]  press KEYS, COUNT times
+ *
+ * Keys read by prompts must be part of KEYS, or the replay waits forever.
+ */
+static void
+replay(void)
+{
+        FILE *fp;
+        const char *tmp;
+        char line[BUFSIZ], label[64], keystr[256], root[PATH_MAX];
+        char dir[PATH_MAX], p50[24], p99[24];
+        int keys[REPLAYKEYS], nk, i, ch, lineno = 0;
+        long count, size = 0, r;
+        ull *ns, t0;
+
+        if ((fp = fopen(replayfile, "r")) == NULL)
+                die("fopen %s:", replayfile);
+        if ((tmp = getenv("TMPDIR")) == NULL)
+                tmp = "/tmp";
+        snprintf(root, sizeof(root), "%s/sfm.replay.XXXXXX", tmp);
+        if (mkdtemp(root) == NULL)
+                die("mkdtemp:");
+
+        printf("%-16s %8s %7s %10s %10s %10s\n",
+               "action", "entries", "n", "p50", "p99", "max");
+        while (f_running && fgets(line, sizeof(line), fp) != NULL) {
+                lineno++;
+                if (line[strspn(line, " \t\n")] == '\0' || line[0] == '#')
+                        continue;
+                if (sscanf(line, "dir %ld", &size) == 1) {
+                        if (snprintf(dir, sizeof(dir), "%s/%ld", root,
+                            size) >= sizeof(dir))
+                                die("%s: path too long", root);
+                        replaypopulate(dir, size);
+                        echdir(root, (dev_t)-1, NULL);
+                        f_redraw = 1;
+                        draw();
+                        /* earlier dirs are still there, point at this one */
+                        if ((r = tabfind(win, strrchr(dir, '/') + 1)) >= 0)
+                                win->sel = r;
+                        draw();
+                        refresh();
+                        continue;
+                }
+                count = 1;
+                if (sscanf(line, "key %63s %255s %ld", label, keystr,
+                    &count) < 2 || count < 1 ||
+                    (nk = replaykeys(keystr, keys, REPLAYKEYS)) <= 0)
+                        die("%s:%d: bad line", replayfile, lineno);
+
+                ns = emalloc(count * sizeof(ull));
+                for (r = 0; r < count && f_running; r++) {
+                        t0 = perfclock();
+                        perfreset();
+                        /* ungetch(3) is a stack, push in reverse */
+                        ungetch(REPLAYEND);
+                        for (i = nk; i-- > 0;)
+                                ungetch(keys[i]);
+                        while ((ch = getch()) != REPLAYEND)
+                                keyrun(ch);
+                        draw();
+                        refresh();
+                        ns[r] = perfclock() - t0;
+                }
+                qsort(ns, r, sizeof(ull), ullcmp);
+                strcpy(p50, fmtns(ns[(r - 1) / 2]));
+                strcpy(p99, fmtns(ns[(r * 99 + 99) / 100 - 1]));
+                printf("%-16s %8ld %7ld %10s %10s %10s\n", label, size, r,
+                       p50, p99, fmtns(ns[r - 1]));
+                fflush(stdout);
+                free(ns);
         }
+        fclose(fp);
+        nftw(root, tmprm, 16, FTW_DEPTH | FTW_PHYS);
+}
 
-        ENTSORT(win->ents, win->nents);
+static int
+ullcmp(const void *x, const void *y)
+{
+        ull a = *(const ull *)x, b = *(const ull *)y;
+
+        return (a > b) - (a < b);
 }
 
 static void
-prompt(const Arg *arg)
+perfreset(void)
 {
-        char buf[BUFSIZ];
+        memset(perffrm, 0, sizeof(perffrm));
+}
 
-        sprintf(buf, "%s", promptstr(msgs[MSG_PROMPT]));
-        if (confirmact(buf)) {
-                spawn(buf);
-                f_redraw = 1;
-        }
+static void
+perfhud(const Arg *arg)
+{
+        f_perfhud ^= 1;
 }
 
 static void
-selcorrect(void)
+perfdraw(void)
 {
-        if (win->sel < 0)
-                win->sel = 0;
-        else if (win->sel > win->nents - 1)
-                win->sel = win->nents - 1;
+        Perfstat *ps;
+        int i = 0, x = MAX(XMAX - 56, 0);
+        char p50[24];
 
-        /* TODO: count `onscreen` */
-        /* FIXME: BUGS! NAV_BOTTOM doesn't work. Resets after using exec  */
-        if (win->sel > YMAX - 4 - SCROLLOFF) {
-                cur = YMAX - 4 - SCROLLOFF;
-                /*if (win->sel == win->nents - 1)*/
-                        /*return;*/
-                /*else*/
-                curscroll += scrolldir;
-        } else {
-                cur = win->sel;
-                curscroll = 0;
+        attron(COLOR_PAIR(C_INF) | A_REVERSE);
+        mvprintw(1, x, "%-9s %7s %6s %8s %10s %10s",
+                 "", "calls", "sys", "alloc", "p50", "p99");
+        for (; i < P_LAST; i++) {
+                ps = &perffrm[i];
+                strcpy(p50, fmtns(perfpct(ps, 50)));
+                mvprintw(i + 2, x, "%-9s %7lu %6lu %8s %10s ",
+                         perfnames[i], ps->calls, ps->sys,
+                         fmtsize(ps->bytes), p50);
+                printw("%10s", fmtns(perfpct(ps, 99)));
         }
+        attroff(COLOR_PAIR(C_INF) | A_REVERSE);
 }
 
 static void
-entcleanup(void)
+perfdump(void)
 {
+        Perfstat *ps;
         int i = 0;
+        char p50[24];
 
-        if (win->ents != NULL) {
-                for (; i < win->nents; i++)
-                        if (win->ents[i].name != NULL)
-                                free(win->ents[i].name);
-                free(win->ents);
+        fprintf(stderr, "%-9s %9s %9s %9s %10s %10s\n",
+                "", "calls", "sys", "alloc", "p50", "p99");
+        for (; i < P_LAST; i++) {
+                ps = &perf[i];
+                strcpy(p50, fmtns(perfpct(ps, 50)));
+                fprintf(stderr, "%-9s %9lu %9lu %9s %10s ",
+                        perfnames[i], ps->calls, ps->sys,
+                        fmtsize(ps->bytes), p50);
+                fprintf(stderr, "%10s\n", fmtns(perfpct(ps, 99)));
         }
 }
 
-static void
-escape(char *buf, const char *str)
+static Tracebuf *
+traceattach(const char *name)
 {
-        for (; *str; str++) {
-                switch (*str) {
-                case ' ':  /* FALLTHROUGH */
-                case '\'': /* FALLTHROUGH */
-                case '(':  /* FALLTHROUGH */
-                case ')':  /* FALLTHROUGH */
-                        *buf++ = '\\';
-                }
-                *buf++ = *str;
+        Tracebuf *tb;
+        uchar idle;
+
+        if (tracefp == NULL)
+                return NULL;
+        if ((tb = pthread_getspecific(tracekey)) != NULL)
+                return tb;
+
+        /*
+         * parallel() threads come and go all the time, so take over the
+         * ring of one that exited once the flusher has emptied it.
+         */
+        tb = __atomic_load_n(&tracebufs, __ATOMIC_ACQUIRE);
+        for (; tb != NULL; tb = tb->next) {
+                idle = 1;
+                if (__atomic_load_n(&tb->name, __ATOMIC_ACQUIRE) == NULL &&
+                    __atomic_load_n(&tb->tail, __ATOMIC_ACQUIRE) == tb->head &&
+                    __atomic_compare_exchange_n(&tb->idle, &idle, 0, 0,
+                                                __ATOMIC_ACQ_REL,
+                                                __ATOMIC_RELAXED))
+                        break;
         }
-        *buf = '\0';
+        if (tb == NULL) {
+                if ((tb = calloc(1, sizeof(Tracebuf))) == NULL)
+                        return NULL;
+                tb->next = __atomic_load_n(&tracebufs, __ATOMIC_RELAXED);
+                while (!__atomic_compare_exchange_n(&tracebufs, &tb->next,
+                                                    tb, 1, __ATOMIC_RELEASE,
+                                                    __ATOMIC_RELAXED))
+                        ;
+        }
+        tb->tid = __atomic_add_fetch(&tracetids, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&tb->name, name, __ATOMIC_RELEASE);
+        pthread_setspecific(tracekey, tb);
+
+        return tb;
 }
 
+/* pthread_key_create(3) destructor, the flusher drains what's left */
 static void
-xdelay(useconds_t delay)
+tracedetach(void *arg)
 {
-        refresh();
-        usleep(delay);
+        Tracebuf *tb = arg;
+
+        __atomic_store_n(&tb->idle, 1, __ATOMIC_RELEASE);
 }
 
 static void
-echdir(const char *path)
+tracepush(int id, const Perfmark *m, ull now)
 {
-        if (chdir(path) != 0) {
-                notify(MSG_FAIL, NULL);
-                xdelay(DELAY_MS << 2);
+        Tracebuf *tb;
+        Traceev *ev;
+        ulong head;
+
+        if ((tb = traceattach("thread")) == NULL)
+                return;
+        head = tb->head;
+        /* never wait for the flusher, drop the event instead */
+        if (head - __atomic_load_n(&tb->tail, __ATOMIC_ACQUIRE) >= TRACERING) {
+                tb->lost++;
+                return;
+        }
+        ev = &tb->ev[head & (TRACERING - 1)];
+        ev->id = id;
+        ev->ts = m->ns;
+        ev->dur = now - m->ns;
+        ev->arg = m->arg;
+        __atomic_store_n(&tb->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int
+traceflush(void)
+{
+        Tracebuf *tb;
+        Traceev *ev;
+        const char *name;
+        ulong head, tail;
+        ull ts;
+        int n = 0;
+        pid_t pid = getpid();
+
+        tb = __atomic_load_n(&tracebufs, __ATOMIC_ACQUIRE);
+        for (; tb != NULL; tb = tb->next) {
+                if ((name = __atomic_load_n(&tb->name,
+                    __ATOMIC_ACQUIRE)) != NULL) {
+                        fprintf(tracefp, ",\n{\"ph\":\"M\",\"pid\":%d,"
+                                "\"tid\":%d,\"name\":\"thread_name\","
+                                "\"args\":{\"name\":\"%s\"}}",
+                                (int)pid, tb->tid, name);
+                        __atomic_store_n(&tb->name, NULL, __ATOMIC_RELEASE);
+                }
+                head = __atomic_load_n(&tb->head, __ATOMIC_ACQUIRE);
+                for (tail = tb->tail; tail != head; tail++, n++) {
+                        ev = &tb->ev[tail & (TRACERING - 1)];
+                        ts = ev->ts - traceepoch;
+                        fprintf(tracefp, ",\n{\"ph\":\"X\",\"pid\":%d,"
+                                "\"tid\":%d,\"name\":\"%s\","
+                                "\"ts\":%llu.%03llu,\"dur\":%llu.%03llu",
+                                (int)pid, tb->tid, perfnames[ev->id],
+                                ts / 1000, ts % 1000,
+                                ev->dur / 1000, ev->dur % 1000);
+                        if (ev->arg >= 0)
+                                fprintf(tracefp, ",\"args\":{\"arg\":%ld}",
+                                        ev->arg);
+                        fputc('}', tracefp);
+                }
+                __atomic_store_n(&tb->tail, tail, __ATOMIC_RELEASE);
         }
+
+        return n;
 }
 
 static void *
-emalloc(size_t nb)
+traceloop(void *arg)
 {
-        void *p;
+        struct timespec ts = {0, TRACEFLUSH_MS * 1000000L};
 
-        if ((p = malloc(nb)) == NULL)
-                die("emalloc:");
-        return p;
+        while (!__atomic_load_n(&f_tracestop, __ATOMIC_ACQUIRE)) {
+                if (traceflush() > 0)
+                        fflush(tracefp);
+                nanosleep(&ts, NULL);
+        }
+
+        return NULL;
 }
 
 static void
-cleanup(void)
+traceopen(const char *path)
 {
-        entcleanup();
-        free(win);
-        endwin();
+        if ((tracefp = fopen(path, "w")) == NULL)
+                die("fopen %s:", path);
+        if (pthread_key_create(&tracekey, tracedetach) != 0)
+                die("pthread_key_create:");
+        traceepoch = perfclock();
+        /* leading metadata event so every real event can start with ',' */
+        fprintf(tracefp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+                "{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\","
+                "\"args\":{\"name\":\"sfm\"}}", (int)getpid());
+        traceattach("main");
+        if (pthread_create(&traceth, NULL, traceloop, NULL) != 0)
+                die("pthread_create:");
 }
 
 static void
-usage(void)
+traceclose(void)
 {
-        die("usage: %s [-Hi]");
+        Tracebuf *tb;
+        ulong lost = 0;
+
+        if (tracefp == NULL)
+                return;
+        __atomic_store_n(&f_tracestop, 1, __ATOMIC_RELEASE);
+        pthread_join(traceth, NULL);
+        traceflush();
+        fputs("\n]}\n", tracefp);
+        fclose(tracefp);
+        tracefp = NULL;
+
+        for (tb = tracebufs; tb != NULL; tb = tb->next)
+                lost += tb->lost;
+        if (lost > 0)
+                fprintf(stderr, "trace: %lu events dropped\n", lost);
 }
+#endif /* PERF */
 
 static void
-die(const char *fmt, ...)
+draw(void)
 {
-        va_list args;
-        
-        va_start(args, fmt);
-        vfprintf(stderr, fmt, args);
-        va_end(args);
+        Tab *t = &tabs[curtab];
+        ulong n;
+        Bigdir *big;
 
-        if (fmt[0] && fmt[strlen(fmt)-1] == ':') {
-                fputc(' ', stderr);
-                perror(NULL);
-        } else
-                fputc('\n', stderr);
+        PERF_BEGIN(P_LOOP);
+        erase();
 
-        exit(EXIT_FAILURE);
+        tabsync();
+        if (f_redraw && win->mode == M_DIR) {
+                if ((curdir = getcwd(t->dir, sizeof(t->dir))) == NULL)
+                        die("getcwd:");
+
+                /* watch first, so nothing between the two is missed */
+                tabwatch(t);
+                entcleanup();
+                win->ents = entget(curdir, &n, &big, &t->mtime);
+                win->big = big;
+                win->nents = n;
+                t->stale = 0;
+
+                f_redraw = 0;
+                refresh();
+        }
+
+        cmpsync();
+        grepsync();
+        /* TODO: change name */
+        selcorrect();
+        entprint();
+        tabprint();
+        lastdraw = msclock();
+        PERF_END(P_LOOP);
+#ifdef PERF
+        if (f_perfhud)
+                perfdraw();
+#endif /* PERF */
 }
 
 int
 main(int argc, char *argv[])
 {
-        char cwd[PATH_MAX] = {0};
-        int ch, i;
+        int ch;
 
-        win = emalloc(sizeof(Win));
+        win = &tabs[0].win;
+        tabs[0].wd = -1;
         win->ents = NULL;
-        win->sel = win->nsel = win->nents = 0;
+        win->big = NULL;
+        win->sel = win->nents = 0;
+        win->mode = M_DIR;
 
         f_redraw = 1;
         f_namesort = 1;
@@ -904,7 +7111,7 @@ main(int argc, char *argv[])
         if (!setlocale(LC_ALL, ""))
                 die("setlocale:");
 
-        while ((ch = getopt(argc, argv, "Hi")) != -1) {
+        while ((ch = getopt(argc, argv, "Hi" PERFOPTS)) != -1) {
                 switch (ch) {
                 case 'H':
                         f_showall = 1;
@@ -912,6 +7119,17 @@ main(int argc, char *argv[])
                 case 'i':
                         f_info = 1;
                         break;
+#ifdef PERF
+                case 'p':
+                        f_perfdump = 1;
+                        break;
+                case 't':
+                        traceopen(optarg);
+                        break;
+                case 'r':
+                        replayfile = optarg;
+                        break;
+#endif /* PERF */
                 case '?': /* FALLTHROUGH */
                 default:
                         usage();
@@ -920,33 +7138,31 @@ main(int argc, char *argv[])
         argc -= optind;
         argv += optind;
 
+        fsinit();
+#ifdef __linux__
+        infd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif /* __linux__ */
+#ifdef PERF
+        if (replayfile != NULL) {
+                replayterm();
+                cursesinit();
+                draw();
+                replay();
+                cleanup();
+                return 0;
+        }
+#endif /* PERF */
         cursesinit();
 
         while (f_running) {
-                erase();
-
-                if (f_redraw) {
-                        if ((curdir = getcwd(cwd, sizeof(cwd))) == NULL)
-                                die("getcwd:");
-
-                        entcleanup();
-                        win->nents = entcount(curdir);
-                        if ((win->ents = entget(curdir, win->nents)) == NULL)
-                                die("entget:");
+                draw();
 
-                        f_redraw = 0;
-                        refresh();
-                }
-
-                /* TODO: change name */
-                selcorrect();
-                entprint();
+                /* reap programs started by spawnbg() */
+                while (waitpid(-1, NULL, WNOHANG) > 0)
+                        ;
 
                 /*TODO: signal/timeout */
-                if ((ch = getch()) != ERR)
-                        for (i = 0; i < ARRLEN(keys); i++)
-                                if (ch == keys[i].key)
-                                        keys[i].func(&(keys[i].arg));
+                input();
         }
 
         cleanup();